@@ -0,0 +1,429 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <cstdint>
+#include <random>
+#include <vector>
+#include <map>
+#include <set>
+#include <list>
+#include <unordered_map>
+#include <memory_resource>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <algorithm>
+
+#include <benchmark/benchmark.h>
+
+#include "../multi_pool_alloc.hpp"
+
+
+// Allocation strategies under test. Each one provides the allocator for a value type and a per thread
+// context owning whatever state the allocator refers to.
+
+#if defined(MPA_BENCH_MALLOC)
+    #define MPA_BENCH_STD_NAME "std::allocator<" MPA_BENCH_MALLOC ">"
+#else
+    #define MPA_BENCH_STD_NAME "std::allocator"
+#endif
+
+template <template <typename> typename Allocator>
+struct stateless_t
+{
+    struct context_t {};
+
+    template <typename T>
+    using allocator_type = Allocator<T>;
+
+    template <typename T>
+    static auto allocator(context_t&) -> allocator_type<T>
+    {
+        return allocator_type<T>();
+    }
+};
+
+template <typename Resource>
+struct pmr_t
+{
+    struct context_t
+    {
+        Resource resource;
+    };
+
+    template <typename T>
+    using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+    template <typename T>
+    static auto allocator(context_t& context) -> allocator_type<T>
+    {
+        return allocator_type<T>(&context.resource);
+    }
+};
+
+struct mpa_pool_allocator_t
+{
+    struct context_t
+    {
+        mpa::pool_resource_t resource;
+    };
+
+    template <typename T>
+    using allocator_type = mpa::pool_allocator_t<T>;
+
+    template <typename T>
+    static auto allocator(context_t& context) -> allocator_type<T>
+    {
+        return allocator_type<T>(&context.resource);
+    }
+};
+
+using std_t = stateless_t<std::allocator>;
+using std_pmr_t = pmr_t<std::pmr::unsynchronized_pool_resource>;
+using mpa_pmr_t = pmr_t<mpa::pool_resource_t>;
+using mpa_t = stateless_t<mpa::allocator_t>;
+using mpa_thread_heap_t = stateless_t<mpa::thread_heap_allocator_t>;
+
+
+template <size_t Size>
+struct payload_t
+{
+    uint8_t bytes[Size];
+};
+
+
+template <typename Strategy>
+using map_t = std::map<uint64_t, uint64_t, std::less<uint64_t>, typename Strategy::template allocator_type<std::pair<const uint64_t, uint64_t>>>;
+
+template <typename Strategy>
+using set_t = std::set<uint64_t, std::less<uint64_t>, typename Strategy::template allocator_type<uint64_t>>;
+
+template <typename Strategy, typename T>
+using list_t = std::list<T, typename Strategy::template allocator_type<T>>;
+
+template <typename Strategy>
+using unordered_map_t = std::unordered_map<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>,
+    typename Strategy::template allocator_type<std::pair<const uint64_t, uint64_t>>>;
+
+
+auto shuffled_keys(size_t count, uint32_t seed) -> std::vector<uint64_t>
+{
+    std::vector<uint64_t> keys(count);
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        keys[i] = i;
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(seed));
+    return keys;
+}
+
+
+// Growth: a map is built from empty and torn down in insertion order.
+template <typename Strategy>
+auto map_sequential(benchmark::State& state) -> void
+{
+    typename Strategy::context_t context;
+    auto count = uint64_t(state.range(0));
+
+    for (auto _ : state)
+    {
+        map_t<Strategy> map(Strategy::template allocator<std::pair<const uint64_t, uint64_t>>(context));
+        for (auto i = uint64_t(0); i < count; ++i)
+        {
+            map.emplace(i, i);
+        }
+        for (auto i = uint64_t(0); i < count; ++i)
+        {
+            map.erase(i);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * count * 2);
+}
+
+
+// Growth with frees in random order, scattering them over all blocks.
+template <typename Strategy>
+auto map_random_free(benchmark::State& state) -> void
+{
+    typename Strategy::context_t context;
+    auto count = uint64_t(state.range(0));
+    auto insert_keys = shuffled_keys(count, 1);
+    auto erase_keys = shuffled_keys(count, 2);
+
+    for (auto _ : state)
+    {
+        map_t<Strategy> map(Strategy::template allocator<std::pair<const uint64_t, uint64_t>>(context));
+        for (auto key : insert_keys)
+        {
+            map.emplace(key, key);
+        }
+        for (auto key : erase_keys)
+        {
+            map.erase(key);
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * count * 2);
+}
+
+
+// Steady state: a populated set where every operation frees one random node and allocates another.
+template <typename Strategy>
+auto set_churn(benchmark::State& state) -> void
+{
+    typename Strategy::context_t context;
+    auto count = uint64_t(state.range(0));
+    std::mt19937_64 mt(3);
+
+    set_t<Strategy> set(Strategy::template allocator<uint64_t>(context));
+    while (set.size() < count)
+    {
+        set.insert(mt() % (count * 4));
+    }
+
+    for (auto _ : state)
+    {
+        auto it = set.lower_bound(mt() % (count * 4));
+        set.erase(it == set.end() ? set.begin() : it);
+        while (!set.insert(mt() % (count * 4)).second)
+        {
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+
+// Steady state list node churn with objects of varying size.
+template <typename Strategy, size_t Size>
+auto list_churn(benchmark::State& state) -> void
+{
+    typename Strategy::context_t context;
+    auto count = uint64_t(state.range(0));
+    std::mt19937 mt(4);
+
+    list_t<Strategy, payload_t<Size>> list(Strategy::template allocator<payload_t<Size>>(context));
+    for (auto i = uint64_t(0); i < count; ++i)
+    {
+        list.emplace_back();
+    }
+
+    auto it = list.begin();
+    for (auto _ : state)
+    {
+        // Walk a random distance, so frees do not follow allocation order.
+        for (auto steps = mt() % 8; steps; --steps)
+        {
+            if (++it == list.end())
+            {
+                it = list.begin();
+            }
+        }
+        it = list.erase(it);
+        it = list.emplace(it == list.end() ? list.begin() : it);
+    }
+
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+
+template <typename Strategy>
+auto unordered_map_churn(benchmark::State& state) -> void
+{
+    typename Strategy::context_t context;
+    auto count = uint64_t(state.range(0));
+    std::mt19937_64 mt(5);
+
+    unordered_map_t<Strategy> map(Strategy::template allocator<std::pair<const uint64_t, uint64_t>>(context));
+    map.reserve(count);
+    for (auto i = uint64_t(0); i < count; ++i)
+    {
+        map.emplace(i, i);
+    }
+
+    auto next_key = count;
+    for (auto _ : state)
+    {
+        map.erase(next_key - count + mt() % 16);
+        map.emplace(next_key, next_key);
+        ++next_key;
+    }
+
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+
+// Every benchmark thread churns its own map. Shows how the shared state of an allocator scales.
+template <typename Strategy>
+auto map_per_thread(benchmark::State& state) -> void
+{
+    typename Strategy::context_t context;
+    auto count = uint64_t(state.range(0));
+    std::mt19937_64 mt(state.thread_index());
+
+    map_t<Strategy> map(Strategy::template allocator<std::pair<const uint64_t, uint64_t>>(context));
+
+    for (auto _ : state)
+    {
+        for (auto i = uint64_t(0); i < count; ++i)
+        {
+            map.emplace(mt(), i);
+        }
+        map.clear();
+    }
+
+    state.SetItemsProcessed(state.iterations() * count * 2);
+}
+
+
+// A producer thread allocates lists that are freed by a consumer thread.
+template <typename Strategy>
+auto producer_consumer(benchmark::State& state) -> void
+{
+    using list = list_t<Strategy, uint64_t>;
+    static constexpr uint64_t lists_per_iteration = 64;
+    auto count = uint64_t(state.range(0));
+
+    for (auto _ : state)
+    {
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        std::queue<list> queue;
+
+        std::thread producer([&]()
+        {
+            typename Strategy::context_t context;
+            for (auto i = uint64_t(0); i < lists_per_iteration; ++i)
+            {
+                list nodes(Strategy::template allocator<uint64_t>(context));
+                for (auto j = uint64_t(0); j < count; ++j)
+                {
+                    nodes.push_back(j);
+                }
+
+                std::lock_guard<std::mutex> lg(queue_mutex);
+                queue.push(std::move(nodes));
+                queue_cv.notify_one();
+            }
+
+            // The context owns the memory of pmr lists, wait until all of them are gone.
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [&]() { return queue.empty(); });
+        });
+
+        for (auto i = uint64_t(0); i < lists_per_iteration; ++i)
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [&]() { return !queue.empty(); });
+            auto nodes = std::move(queue.front());
+            queue.pop();
+            lock.unlock();
+            nodes.clear();
+            queue_cv.notify_one();
+        }
+
+        producer.join();
+    }
+
+    state.SetItemsProcessed(state.iterations() * lists_per_iteration * count * 2);
+}
+
+
+// A multi_pool_t with a placement policy, where objects freed a moment ago are allocated again right away.
+template <mpa::placement_t Placement>
+auto ping_pong(benchmark::State& state) -> void
+{
+    using payload_type = payload_t<64>;
+    mpa::multi_pool_t<payload_type, mpa::heap_block_provider_t, mpa::adaptive_geometry_t<>, Placement> pool;
+    auto count = uint64_t(state.range(0));
+    std::mt19937 mt(6);
+
+    std::vector<payload_type*> objects(count);
+    for (auto& object : objects)
+    {
+        object = pool.allocate(1);
+    }
+
+    for (auto _ : state)
+    {
+        // Frees stay within a small window, so the freed slots are still cache hot when reused.
+        auto& object = objects[count / 2 + mt() % 256];
+        pool.deallocate(object, 1);
+        object = pool.allocate(1);
+        benchmark::DoNotOptimize(object->bytes[0] = 1);
+    }
+
+    for (auto object : objects)
+    {
+        pool.deallocate(object, 1);
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+
+// pmr resources are not thread safe and their memory is owned by the producer, so it is left out of the
+// cross thread scenarios. The bucket arrays of std::unordered_map are longer than the runs the mpa pools
+// serve, the mpa allocators get them from operator new and mpa::pool_resource_t from its upstream resource.
+#define MPA_BENCH_ALL(function, ...) \
+    BENCHMARK_TEMPLATE(function, std_t)->Name(#function "/" MPA_BENCH_STD_NAME)__VA_ARGS__; \
+    BENCHMARK_TEMPLATE(function, std_pmr_t)->Name(#function "/std::pmr::unsynchronized_pool_resource")__VA_ARGS__; \
+    BENCHMARK_TEMPLATE(function, mpa_pmr_t)->Name(#function "/mpa::pool_resource_t")__VA_ARGS__; \
+    BENCHMARK_TEMPLATE(function, mpa_pool_allocator_t)->Name(#function "/mpa::pool_allocator_t")__VA_ARGS__; \
+    BENCHMARK_TEMPLATE(function, mpa_t)->Name(#function "/mpa::allocator_t")__VA_ARGS__; \
+    BENCHMARK_TEMPLATE(function, mpa_thread_heap_t)->Name(#function "/mpa::thread_heap_allocator_t")__VA_ARGS__
+
+#define MPA_BENCH_SIZES(size) \
+    BENCHMARK_TEMPLATE(list_churn, std_t, size)->Name("list_churn<" #size ">/" MPA_BENCH_STD_NAME)->Arg(1 << 16); \
+    BENCHMARK_TEMPLATE(list_churn, std_pmr_t, size)->Name("list_churn<" #size ">/std::pmr::unsynchronized_pool_resource")->Arg(1 << 16); \
+    BENCHMARK_TEMPLATE(list_churn, mpa_pmr_t, size)->Name("list_churn<" #size ">/mpa::pool_resource_t")->Arg(1 << 16); \
+    BENCHMARK_TEMPLATE(list_churn, mpa_pool_allocator_t, size)->Name("list_churn<" #size ">/mpa::pool_allocator_t")->Arg(1 << 16); \
+    BENCHMARK_TEMPLATE(list_churn, mpa_t, size)->Name("list_churn<" #size ">/mpa::allocator_t")->Arg(1 << 16); \
+    BENCHMARK_TEMPLATE(list_churn, mpa_thread_heap_t, size)->Name("list_churn<" #size ">/mpa::thread_heap_allocator_t")->Arg(1 << 16)
+
+MPA_BENCH_ALL(map_sequential, ->Arg(1 << 10)->Arg(1 << 15)->Arg(1 << 20));
+MPA_BENCH_ALL(map_random_free, ->Arg(1 << 10)->Arg(1 << 15)->Arg(1 << 20));
+MPA_BENCH_ALL(set_churn, ->Arg(1 << 10)->Arg(1 << 20));
+MPA_BENCH_SIZES(8);
+MPA_BENCH_SIZES(32);
+MPA_BENCH_SIZES(128);
+MPA_BENCH_SIZES(512);
+MPA_BENCH_ALL(map_per_thread, ->Arg(1 << 12)->ThreadRange(1, 32)->UseRealTime());
+
+BENCHMARK_TEMPLATE(unordered_map_churn, std_t)->Name("unordered_map_churn/" MPA_BENCH_STD_NAME)->Arg(1 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(unordered_map_churn, std_pmr_t)->Name("unordered_map_churn/std::pmr::unsynchronized_pool_resource")->Arg(1 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(unordered_map_churn, mpa_pmr_t)->Name("unordered_map_churn/mpa::pool_resource_t")->Arg(1 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(unordered_map_churn, mpa_pool_allocator_t)->Name("unordered_map_churn/mpa::pool_allocator_t")->Arg(1 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(unordered_map_churn, mpa_t)->Name("unordered_map_churn/mpa::allocator_t")->Arg(1 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(unordered_map_churn, mpa_thread_heap_t)->Name("unordered_map_churn/mpa::thread_heap_allocator_t")->Arg(1 << 10)->Arg(1 << 20);
+
+BENCHMARK_TEMPLATE(ping_pong, mpa::placement_t::lowest_address)->Name("ping_pong/lowest_address")->Arg(1 << 16);
+BENCHMARK_TEMPLATE(ping_pong, mpa::placement_t::recently_freed)->Name("ping_pong/recently_freed")->Arg(1 << 16);
+BENCHMARK_TEMPLATE(ping_pong, mpa::placement_t::free_list)->Name("ping_pong/free_list")->Arg(1 << 16);
+
+BENCHMARK_TEMPLATE(producer_consumer, std_t)->Name("producer_consumer/" MPA_BENCH_STD_NAME)->Arg(1 << 12)->UseRealTime();
+BENCHMARK_TEMPLATE(producer_consumer, mpa_t)->Name("producer_consumer/mpa::allocator_t")->Arg(1 << 12)->UseRealTime();
+BENCHMARK_TEMPLATE(producer_consumer, mpa_thread_heap_t)->Name("producer_consumer/mpa::thread_heap_allocator_t")->Arg(1 << 12)->UseRealTime();
+
+BENCHMARK_MAIN();
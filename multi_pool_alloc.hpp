@@ -25,19 +25,127 @@
 #define MULTI_POOL_ALLOC_HPP_INCLUDED
 
 #include <cstdint>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
 #include <cassert>
 
 #include <new>
+#include <bit>
 
 #include <concepts>
 #include <type_traits>
+#include <limits>
 
 #include <iterator>
+#include <algorithm>
 
+#include <array>
 #include <vector>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <memory_resource>
 
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <system_error>
+
+// Number of free slots each thread caches per allocator_t<T> in front of the shared pool. 0 disables the cache.
+#if !defined(MPA_THREAD_CACHE_SIZE)
+    #define MPA_THREAD_CACHE_SIZE 0
+#endif
+
+
+// Pool bitmaps and data are aligned to this, so metadata never shares a cache line with objects.
+#if !defined(MPA_CACHE_LINE_SIZE)
+    #define MPA_CACHE_LINE_SIZE 64
+#endif
+
+
+// When non-zero allocator_t and thread_heap_allocator_t round sizeof(T) up to a size class and all types of a
+// class share one pool of raw slots.
+#if !defined(MPA_SIZE_CLASSES)
+    #define MPA_SIZE_CLASSES 0
+#endif
+
+
+// Block provider used by the pools of allocator_t and thread_heap_allocator_t.
+#if !defined(MPA_BLOCK_PROVIDER)
+    #define MPA_BLOCK_PROVIDER mpa::heap_block_provider_t
+#endif
+
+
+// Pool geometry policy used by the pools of allocator_t and thread_heap_allocator_t.
+#if !defined(MPA_GEOMETRY)
+    #define MPA_GEOMETRY mpa::adaptive_geometry_t<>
+#endif
+
+
+// Slot placement policy used by the pools of allocator_t and thread_heap_allocator_t.
+#if !defined(MPA_PLACEMENT)
+    #define MPA_PLACEMENT mpa::placement_t::lowest_address
+#endif
+
+
+// Number of freed slots a multi_pool_t with placement_t::free_list keeps on its free list before flushing them to
+// the bitmaps.
+#if !defined(MPA_FREE_LIST_SIZE)
+    #define MPA_FREE_LIST_SIZE 64
+#endif
+
+
+// When non-zero multi_pool_t counts its operations and allocator_t the time it waits for its mutex, see stats().
+#if !defined(MPA_STATS)
+    #define MPA_STATS 0
+#endif
+
+
+// When non-zero deallocate aborts on double frees, pointers of other pools and pointers that do not start a slot.
+#if !defined(MPA_HARDENED)
+    #define MPA_HARDENED 0
+#endif
+
+
+// When non-zero freed slots are overwritten with 0xdd bytes, so stale reads find garbage instead of the old object.
+#if !defined(MPA_POISON)
+    #define MPA_POISON 0
+#endif
+
+
+// When non-zero allocator_t records every allocation and deallocation between start_trace and stop_trace.
+#if !defined(MPA_TRACE)
+    #define MPA_TRACE 0
+#endif
+
+
+// Number of empty blocks a multi_pool_t keeps before deallocate starts giving them back to the system.
+#if !defined(MPA_RETAINED_EMPTY_BLOCKS)
+    #define MPA_RETAINED_EMPTY_BLOCKS 1
+#endif
+
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/file.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #if defined(__linux__)
+        #include <sched.h>
+        #include <sys/syscall.h>
+    #endif
+#elif defined(_WIN32)
+    #if !defined(NOMINMAX)
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#endif
 
 #if defined(_MSC_VER)
     #include <intrin.h>
@@ -45,10 +153,30 @@
     #pragma intrinsic(_BitScanForward64)
 #endif
 
+// Under AddressSanitizer free slots are poisoned, so accesses to freed objects inside a pool are reported.
+#if defined(__SANITIZE_ADDRESS__)
+    #define MPA_ASAN 1
+#elif defined(__has_feature)
+    #if __has_feature(address_sanitizer)
+        #define MPA_ASAN 1
+    #endif
+#endif
+
+#if defined(MPA_ASAN)
+    #include <sanitizer/asan_interface.h>
+#endif
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
 
 namespace mpa
 {
     using u8_t = uint8_t;
+    using u16_t = uint16_t;
     using u32_t = uint32_t;
     using u64_t = uint64_t;
     using bool_t = bool;
@@ -67,6 +195,12 @@ namespace mpa
 
     template <typename T>
     concept pointer_type = std::is_pointer<T>::value;
+
+    inline constexpr size_t cache_line_size = MPA_CACHE_LINE_SIZE;
+    inline constexpr bool_t stats_enabled = MPA_STATS != 0;
+    inline constexpr bool_t hardened = MPA_HARDENED != 0;
+    inline constexpr bool_t poison_enabled = MPA_POISON != 0;
+    inline constexpr bool_t trace_enabled = MPA_TRACE != 0;
 }
 
 
@@ -90,15 +224,324 @@ namespace mpa::impl
         return ctz<u32_t>(u32_t(n));
     }
 
+    // Bits of slots at which a run of count set bits starts, 1 <= count <= bits of T.
+    template <typename T>
+        requires std::unsigned_integral<T>
+    inline auto run_starts(T slots, u32_t count) -> T;
+
+    // Index of the first word with a run of count set bits among the words whose bit is set in candidates,
+    // or the number of bits of T if there is none. words holds one word per bit of T, like a pool bitmap.
+    template <typename T>
+        requires std::unsigned_integral<T>
+    inline auto find_run(const T* words, T candidates, u32_t count) -> u32_t;
+
+#if defined(__AVX512F__) || defined(__AVX2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    template <>
+    inline auto find_run<u64_t>(const u64_t* words, u64_t candidates, u32_t count) -> u32_t;
+#endif
+
     template <typename WordType>
         requires std::unsigned_integral<WordType>
     struct block_t
     {
         void* ptr;
         WordType unmaxed_pools;
+        u32_t live_slots;
+        // Pools from this index on were never initialized. They are initialized when first allocated from, so
+        // untouched pools never fault in their pages.
+        u32_t initialized_pools;
+        // NUMA node reported by the block provider when the block was created.
+        u32_t node;
+        // Occupancy bucket the block is tracked in.
+        u32_t bucket;
+        // The pages past the header were given back to the system.
+        bool_t decommitted;
+        // No run of free slots in the block is longer. Lowered when a search for a longer run fails, raised to
+        // the longest possible run by any free.
+        u32_t run_bound;
+    };
+
+
+    // Every block starts with this header. Blocks are aligned to their (power of two) span, so the header
+    // of the block owning an arbitrary slot is found by masking the low bits of the slot address.
+    struct block_header_t
+    {
+        size_t index;
+        // The multi_pool_t the block belongs to.
+        void_t* owner;
+        // Lock free list of slots freed by other threads, linked through the slots themselves.
+        std::atomic<void_t*> remote_frees;
+        // Link in the owner's list of blocks with pending remote frees.
+        block_header_t* next_remote;
+        // Copy of block_t::initialized_pools kept only for persistent block providers, so a later run can
+        // tell untouched pools from full ones.
+        u32_t initialized_pools;
+    };
+
+
+    constexpr auto align_up(size_t n, size_t alignment) -> size_t
+    {
+        return (n + alignment - 1) & ~(alignment - 1);
+    }
+
+
+    template <size_t BlockAlignment>
+    auto block_header_of(const void_t* ptr) -> block_header_t*
+    {
+        static_assert(std::has_single_bit(BlockAlignment));
+        return (block_header_t*)(uintptr_t(ptr) & ~uintptr_t(BlockAlignment - 1));
+    }
+
+
+    // Called by the MPA_HARDENED checks, never returns.
+    [[noreturn]] inline auto report_misuse(const char* what) -> void_t
+    {
+        fprintf(stderr, "mpa: %s\n", what);
+        abort();
+    }
+
+    // Mark memory as unaddressable or addressable again for AddressSanitizer, no-ops without it.
+    inline auto poison(const void_t* ptr, size_t size) -> void_t
+    {
+#if defined(MPA_ASAN)
+        ASAN_POISON_MEMORY_REGION(ptr, size);
+#endif
+    }
+
+    inline auto unpoison(const void_t* ptr, size_t size) -> void_t
+    {
+#if defined(MPA_ASAN)
+        ASAN_UNPOISON_MEMORY_REGION(ptr, size);
+#endif
+    }
+
+    // Asks for the cache line holding ptr ahead of a write, a no-op without a prefetch intrinsic. Never faults,
+    // so ptr may point to memory that is not mapped yet.
+    inline auto prefetch(const void_t* ptr) -> void_t
+    {
+#if defined(__GNUC__)
+        __builtin_prefetch(ptr, 1, 3);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_prefetch((const char*)ptr, _MM_HINT_T0);
+#endif
+    }
+
+    // Overwrites freed slots if MPA_POISON is enabled.
+    inline auto fill_freed(void_t* ptr, size_t size) -> void_t
+    {
+        if constexpr (poison_enabled)
+        {
+            memset(ptr, 0xdd, size);
+        }
+    }
+
+
+    // Raw storage for one object of a size class.
+    template <size_t Size, size_t Alignment>
+    struct slot_t
+    {
+        alignas(Alignment) u8_t bytes[Size];
     };
 
 
+    // Multiples of 16 up to 128 bytes, above that four classes per power of two.
+    constexpr auto size_class(size_t size) -> size_t
+    {
+        if (size <= 128)
+        {
+            return align_up(size, 16);
+        }
+
+        return align_up(size, std::bit_floor(size - 1) / 4);
+    }
+
+
+    // Position of size_class(size) in the sequence of all size classes.
+    constexpr auto size_class_index(size_t size) -> size_t
+    {
+        if (size <= 128)
+        {
+            return (std::max(size, size_t(1)) + 15) / 16 - 1;
+        }
+
+        auto base = std::bit_floor(size - 1);
+        return 8 + 4 * (std::countr_zero(base) - 7) + (size_class(size) - base) / (base / 4) - 1;
+    }
+
+
+    constexpr auto size_class_of_index(size_t index) -> size_t
+    {
+        if (index < 8)
+        {
+            return 16 * (index + 1);
+        }
+
+        auto base = size_t(128) << ((index - 8) / 4);
+        return base + base / 4 * ((index - 8) % 4 + 1);
+    }
+
+
+    // The alignment every slot of a size class satisfies, capped at the fundamental alignment.
+    constexpr auto size_class_alignment(size_t size_class) -> size_t
+    {
+        return std::min(size_class & ~(size_class - 1), alignof(std::max_align_t));
+    }
+
+
+    // Over-aligned types do not fit the shared classes and get slots of their own.
+    template <typename T, size_t Class = size_class(sizeof(T))>
+    using size_class_slot_t = std::conditional_t<
+        alignof(T) <= size_class_alignment(Class),
+        slot_t<Class, size_class_alignment(Class)>,
+        slot_t<align_up(sizeof(T), alignof(T)), alignof(T)>>;
+
+
+    // Type whose pool serves allocations of T.
+    template <typename T>
+    using storage_t = std::conditional_t<MPA_SIZE_CLASSES != 0, size_class_slot_t<T>, T>;
+
+    // Type of the thread heaps serving T. Slots freed by other threads are queued through their first bytes,
+    // so smaller types get slots of a pointer.
+    template <typename T>
+    using heap_storage_t = std::conditional_t<sizeof(storage_t<T>) >= sizeof(void_t*), storage_t<T>,
+        slot_t<sizeof(void_t*), alignof(void_t*)>>;
+
+
+    inline auto page_size() -> size_t
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        static const auto size = size_t(sysconf(_SC_PAGESIZE));
+#elif defined(_WIN32)
+        static const auto size = []()
+        {
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return size_t(info.dwPageSize);
+        }();
+#else
+        static const auto size = size_t(4096);
+#endif
+        return size;
+    }
+
+
+    // Gives the whole pages in [ptr, ptr + size) back to the system while keeping them mapped. They read as
+    // zero afterwards. Returns false where this is not supported.
+    inline auto decommit(void_t* ptr, size_t size) -> bool_t
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        auto begin = align_up(uintptr_t(ptr), page_size());
+        auto end = (uintptr_t(ptr) + size) & ~uintptr_t(page_size() - 1);
+
+        if (begin < end)
+        {
+            madvise((void_t*)begin, end - begin, MADV_DONTNEED);
+        }
+        return true;
+#else
+        return false;
+#endif
+    }
+
+
+    // NUMA node of the CPU the calling thread runs on, 0 where this is unknown.
+    inline auto numa_node() -> u32_t
+    {
+#if defined(__linux__)
+        unsigned cpu = 0;
+        unsigned node = 0;
+        if (getcpu(&cpu, &node) == 0)
+        {
+            return node;
+        }
+#endif
+        return 0;
+    }
+
+
+    // Prefers node for the pages of [ptr, ptr + size) that are not faulted in yet. mbind is called through
+    // syscall, so there is no libnuma dependency. Failures are ignored, the memory is usable either way.
+    inline auto bind_to_numa_node(void_t* ptr, size_t size, u32_t node) -> void_t
+    {
+#if defined(__linux__) && defined(SYS_mbind)
+        static constexpr int preferred_policy = 1;
+        static constexpr size_t max_nodes = 1024;
+        static constexpr size_t mask_bits = sizeof(unsigned long) * 8;
+
+        if (node >= max_nodes)
+        {
+            return;
+        }
+
+        unsigned long node_mask[max_nodes / mask_bits] = {};
+        node_mask[node / mask_bits] = 1ul << (node % mask_bits);
+        syscall(SYS_mbind, ptr, size, preferred_policy, node_mask, max_nodes, 0);
+#endif
+    }
+
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Maps size bytes at an address aligned to alignment, which must be a multiple of the page size.
+    // The range is reserved first, so extra flags like MAP_HUGETLB only apply to the final mapping.
+    inline auto map_aligned(size_t size, size_t alignment, int flags) -> void_t*
+    {
+        auto reserved_size = size + alignment;
+        auto reserved = mmap(nullptr, reserved_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserved == MAP_FAILED)
+        {
+            return nullptr;
+        }
+
+        auto begin = align_up(uintptr_t(reserved), alignment);
+        auto end = begin + size;
+        if (begin != uintptr_t(reserved))
+        {
+            munmap(reserved, begin - uintptr_t(reserved));
+        }
+        if (end != uintptr_t(reserved) + reserved_size)
+        {
+            munmap((void_t*)end, uintptr_t(reserved) + reserved_size - end);
+        }
+
+        auto ptr = mmap((void_t*)begin, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | flags, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            munmap((void_t*)begin, size);
+            return nullptr;
+        }
+
+        return ptr;
+    }
+#elif defined(_WIN32)
+    inline auto map_aligned(size_t size, size_t alignment, DWORD flags) -> void_t*
+    {
+        // Find an aligned range by reserving a larger one, then map exactly the aligned part. Another
+        // thread may grab the range in between, in which case we try again.
+        for (;;)
+        {
+            auto reserved = VirtualAlloc(nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+            if (!reserved)
+            {
+                return nullptr;
+            }
+
+            auto begin = (void_t*)align_up(uintptr_t(reserved), alignment);
+            VirtualFree(reserved, 0, MEM_RELEASE);
+
+            if (auto ptr = VirtualAlloc(begin, size, MEM_RESERVE | MEM_COMMIT | flags, PAGE_READWRITE))
+            {
+                return ptr;
+            }
+
+            if (flags & MEM_LARGE_PAGES)
+            {
+                return nullptr;
+            }
+        }
+    }
+#endif
+
+
     template <typename T, typename U>
         requires std::unsigned_integral<T>&& std::unsigned_integral<U>
     auto set_bit(T& n, U bit) -> void_t
@@ -172,235 +615,3838 @@ namespace mpa::impl
     }
 #endif
 
-}
-
 
-namespace mpa
-{
-    template <typename T, typename WordType = u64_t>
-        requires std::unsigned_integral<WordType>
-    struct pool_t
+    template <typename T>
+        requires std::unsigned_integral<T>
+    inline auto run_starts(T slots, u32_t count) -> T
     {
-        using word_type = WordType;
-        word_type unused_words;
-        static constexpr u32_t word_bits = sizeof(WordType) * 8;
-        static constexpr u32_t pool_size = word_bits * word_bits;
-        word_type unallocated_slots[word_bits];
-        T data[pool_size];
-
-        auto init() -> void_t;
-        auto allocate() -> T*;
-        auto deallocate(T* ptr) -> void_t;
-        auto full() -> bool_t;
-    };
+        // After the shifted ands cover count bits, bit i is left set only if bits i to i + count - 1 are all
+        // set. The shift doubles each step, so this takes log2(count) steps.
+        auto starts = slots;
+        for (auto run = 1u; run < count && starts;)
+        {
+            auto shift = std::min(run, count - run);
+            starts &= T(starts >> shift);
+            run += shift;
+        }
+        return starts;
+    }
 
     template <typename T>
-    class multi_pool_t
+        requires std::unsigned_integral<T>
+    inline auto find_run(const T* words, T candidates, u32_t count) -> u32_t
     {
-    public:
-        multi_pool_t();
-        ~multi_pool_t();
-        auto allocate(size_t n) -> T*;
-        auto deallocate(T* ptr, size_t n) -> void_t;
-
-    private:
-        static constexpr uint32_t pools_in_block = pool_t<T>::word_bits;
-        using word_type = pool_t<T>::word_type;
+        for (; candidates; candidates &= candidates - 1)
+        {
+            auto word = ctz(candidates);
+            if (run_starts(words[word], count))
+            {
+                return word;
+            }
+        }
+        return sizeof(T) * 8;
+    }
 
-        auto new_block() -> void_t;
-        vector_t<impl::block_t<word_type>> memory_blocks;
-    };
+    // The vector versions run the shifted ands of run_starts on a group of words at once. Groups without
+    // candidates are skipped, so sparse candidates cost no more than in the scalar loop.
+#if defined(__AVX512F__)
+    template <>
+    inline auto find_run<u64_t>(const u64_t* words, u64_t candidates, u32_t count) -> u32_t
+    {
+        for (auto first = 0u; first < 64; first += 8)
+        {
+            auto lanes = u32_t(candidates >> first) & 0xff;
+            if (!lanes)
+            {
+                continue;
+            }
 
+            auto starts = _mm512_loadu_si512(words + first);
+            for (auto run = 1u; run < count;)
+            {
+                auto shift = std::min(run, count - run);
+                starts = _mm512_and_si512(starts, _mm512_srl_epi64(starts, _mm_cvtsi32_si128(int(shift))));
+                run += shift;
+            }
 
-    template <typename T>
-    class allocator_t
+            lanes &= u32_t(_mm512_test_epi64_mask(starts, starts));
+            if (lanes)
+            {
+                return first + ctz(lanes);
+            }
+        }
+        return 64;
+    }
+#elif defined(__AVX2__)
+    template <>
+    inline auto find_run<u64_t>(const u64_t* words, u64_t candidates, u32_t count) -> u32_t
     {
-    public:
-        using value_type = T;
-        using size_type = size_t;
-        using difference_type = ptrdiff_t;
-        using propagate_on_container_move_assignment = std::false_type;
-        using propagate_on_container_copy_assignment = std::false_type;
-
-        template <typename U>
-        struct rebind
+        for (auto first = 0u; first < 64; first += 4)
         {
-            using other = allocator_t<U>;
-        };
+            auto lanes = u32_t(candidates >> first) & 0xf;
+            if (!lanes)
+            {
+                continue;
+            }
 
-        allocator_t() noexcept;
+            auto starts = _mm256_loadu_si256((const __m256i*)(words + first));
+            for (auto run = 1u; run < count;)
+            {
+                auto shift = std::min(run, count - run);
+                starts = _mm256_and_si256(starts, _mm256_srl_epi64(starts, _mm_cvtsi32_si128(int(shift))));
+                run += shift;
+            }
 
-        template <typename U>
-        allocator_t(allocator_t<U>& other) noexcept
-        {
-            if (!multi_pool)
+            auto empty = _mm256_cmpeq_epi64(starts, _mm256_setzero_si256());
+            lanes &= ~u32_t(_mm256_movemask_pd(_mm256_castsi256_pd(empty)));
+            if (lanes)
             {
-                multi_pool = new multi_pool_t<T>;
+                return first + ctz(lanes);
             }
         }
+        return 64;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    template <>
+    inline auto find_run<u64_t>(const u64_t* words, u64_t candidates, u32_t count) -> u32_t
+    {
+        for (auto first = 0u; first < 64; first += 2)
+        {
+            auto lanes = u32_t(candidates >> first) & 0x3;
+            if (!lanes)
+            {
+                continue;
+            }
 
-        [[nodiscard]]
+            auto starts = vld1q_u64(words + first);
+            for (auto run = 1u; run < count;)
+            {
+                auto shift = std::min(run, count - run);
+                starts = vandq_u64(starts, vshlq_u64(starts, vdupq_n_s64(-int64_t(shift))));
+                run += shift;
+            }
+
+            lanes &= u32_t(vgetq_lane_u64(starts, 0) != 0) | u32_t(vgetq_lane_u64(starts, 1) != 0) << 1;
+            if (lanes)
+            {
+                return first + ctz(lanes);
+            }
+        }
+        return 64;
+    }
+#endif
+
+
+    // Hierarchical bitmap with one bit per element on the lowest level and one bit per non-zero word of the
+    // level below on every level above it. The lowest set element is found with a single ctz per level.
+    template <typename WordType>
+        requires std::unsigned_integral<WordType>
+    class bit_tree_t
+    {
+    public:
+        static constexpr size_t npos = ~size_t(0);
+
+        auto resize(size_t n) -> void_t;
+        auto set(size_t i) -> void_t;
+        auto clear(size_t i) -> void_t;
+        auto test(size_t i) const -> bool_t;
+        auto find_first() const -> size_t;
+        // Lowest set element at or after i, or npos.
+        auto find_next(size_t i) const -> size_t;
+
+    private:
+        static constexpr u32_t word_bits = sizeof(WordType) * 8;
+
+        vector_t<vector_t<WordType>> levels;
+    };
+
+
+    template <typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto bit_tree_t<WordType>::resize(size_t n) -> void_t
+    {
+        auto words = (n + word_bits - 1) / word_bits;
+        if (!levels.empty() && words <= levels[0].size())
+        {
+            // Shrinking clears the removed elements and keeps the capacity so releasing blocks never
+            // allocates. The upper levels keep their size, their words past the leaves are all zero.
+            for (auto i = find_next(n); i != npos; i = find_next(i + 1))
+            {
+                clear(i);
+            }
+            levels[0].resize(words);
+            return;
+        }
+
+        if (levels.empty())
+        {
+            levels.emplace_back();
+        }
+
+        levels[0].resize(words);
+        levels.resize(1);
+
+        // Growing rebuilds the upper levels, which is linear in the number of leaf words.
+        while (levels.back().size() > 1)
+        {
+            auto& lower = levels.back();
+            vector_t<WordType> upper((lower.size() + word_bits - 1) / word_bits);
+
+            for (auto i = size_t(0); i < lower.size(); ++i)
+            {
+                if (lower[i])
+                {
+                    set_bit(upper[i / word_bits], u32_t(i % word_bits));
+                }
+            }
+
+            levels.push_back(std::move(upper));
+        }
+    }
+
+
+    template <typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto bit_tree_t<WordType>::set(size_t i) -> void_t
+    {
+        for (auto& level : levels)
+        {
+            auto& word = level[i / word_bits];
+            auto was_empty = !word;
+            set_bit(word, u32_t(i % word_bits));
+
+            if (!was_empty)
+            {
+                break;
+            }
+
+            i /= word_bits;
+        }
+    }
+
+
+    template <typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto bit_tree_t<WordType>::clear(size_t i) -> void_t
+    {
+        for (auto& level : levels)
+        {
+            auto& word = level[i / word_bits];
+            clear_bit(word, u32_t(i % word_bits));
+
+            if (word)
+            {
+                break;
+            }
+
+            i /= word_bits;
+        }
+    }
+
+
+    template <typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto bit_tree_t<WordType>::test(size_t i) const -> bool_t
+    {
+        return test_bit(levels[0][i / word_bits], u32_t(i % word_bits));
+    }
+
+
+    template <typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto bit_tree_t<WordType>::find_first() const -> size_t
+    {
+        if (levels.empty() || levels[0].empty() || !levels.back()[0])
+        {
+            return npos;
+        }
+
+        auto i = size_t(0);
+        for (auto level = levels.size() - 1; level < levels.size(); --level)
+        {
+            i = i * word_bits + ctz(levels[level][i]);
+        }
+
+        return i;
+    }
+
+
+    template <typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto bit_tree_t<WordType>::find_next(size_t i) const -> size_t
+    {
+        // Climb until a word has a set bit at or after position i, every level up i becomes the index of the
+        // word after the one searched. Then descend to the lowest element below that bit.
+        auto level = size_t(0);
+        for (; level < levels.size(); ++level)
+        {
+            auto word_idx = i / word_bits;
+            if (word_idx >= levels[level].size())
+            {
+                return npos;
+            }
+
+            auto word = WordType(levels[level][word_idx] & (~WordType(0) << (i % word_bits)));
+            if (word)
+            {
+                i = word_idx * word_bits + ctz(word);
+                break;
+            }
+            i = word_idx + 1;
+        }
+
+        if (level == levels.size())
+        {
+            return npos;
+        }
+        for (; level > 0; --level)
+        {
+            i = i * word_bits + ctz(levels[level - 1][i]);
+        }
+
+        return i;
+    }
+
+}
+
+
+namespace mpa
+{
+    // Block providers hand out the memory of multi_pool_t blocks. allocate must return size bytes aligned to
+    // alignment (a power of two) or throw std::bad_alloc. decommit may give the pages of a range back to
+    // the system and returns false if it did not, commit makes a decommitted range usable again.
+
+    // Blocks from the C++ heap through aligned operator new.
+    struct heap_block_provider_t
+    {
+        auto allocate(size_t size, size_t alignment) -> void_t*;
+        auto deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t;
+        auto decommit(void_t* ptr, size_t size) -> bool_t;
+        auto commit(void_t* ptr, size_t size) -> void_t;
+    };
+
+    // Blocks mapped directly from the system with mmap or VirtualAlloc.
+    struct page_block_provider_t
+    {
+        auto allocate(size_t size, size_t alignment) -> void_t*;
+        auto deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t;
+        auto decommit(void_t* ptr, size_t size) -> bool_t;
+        auto commit(void_t* ptr, size_t size) -> void_t;
+    };
+
+    // Page blocks placed on the NUMA node of the thread that allocates them, so they stay node local whichever
+    // thread touches them first. Since it reports current_node, multi_pool_t keeps the blocks of every node
+    // apart and serves each thread from blocks of its own node. Outside Linux every block is on node 0.
+    struct numa_block_provider_t : page_block_provider_t
+    {
+        auto allocate(size_t size, size_t alignment) -> void_t*;
+        // NUMA node of the calling thread. It is looked up again every refresh_interval calls, threads rarely
+        // migrate between nodes.
+        auto current_node() -> u32_t;
+
+        static constexpr u32_t refresh_interval = 256;
+    };
+
+    // Blocks backed by huge pages to cut TLB misses. Tries MAP_HUGETLB (large pages on Windows) first and
+    // falls back to regular pages, advised as transparent huge pages where available. Blocks are rounded up
+    // to whole huge pages.
+    struct huge_page_block_provider_t
+    {
+        static constexpr size_t huge_page_size = size_t(1) << 21;
+
+        auto allocate(size_t size, size_t alignment) -> void_t*;
+        auto deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t;
+        auto decommit(void_t* ptr, size_t size) -> bool_t;
+        auto commit(void_t* ptr, size_t size) -> void_t;
+    };
+
+#if defined(__unix__) || defined(__APPLE__)
+    // File mapped at the same address in every run, so pointers stored in it stay valid. It hands out the
+    // blocks of mapped_file_block_provider_t and keeps a directory of them, and root() has room for the
+    // objects the rest of the data hangs off, e.g. a basic_pool_resource_t and the containers built on it.
+    // Pages reach the file whenever the system writes them back, sync() forces that. A run that crashes can
+    // leave the file inconsistent.
+    class mapped_file_t
+    {
+    public:
+        static constexpr size_t root_size = 16384;
+
+        // Maps path at base, which must be page aligned, creating the file with capacity bytes if it does not
+        // exist or was never set up. A file this constructor created is emptied again when it throws. Throws
+        // std::system_error if the file cannot be opened, is mapped by another process or cannot be mapped at
+        // base, and std::runtime_error if it is not a mapped file or was created for another base.
+        mapped_file_t(const char* path, void_t* base, size_t capacity);
+        mapped_file_t(const mapped_file_t&) = delete;
+        auto operator=(const mapped_file_t&) -> mapped_file_t& = delete;
+        ~mapped_file_t();
+
+        // Whether the file existed, so that root() holds what the previous run left there.
+        auto restored() const -> bool_t;
+        auto root() const -> void_t*;
+        auto sync() -> void_t;
+
+        auto allocate(size_t size, size_t alignment) -> void_t*;
+        auto deallocate(void_t* ptr, size_t size) -> void_t;
+        // Calls function(ptr, size) for every block handed out and not deallocated, in address order.
+        template <typename Function>
+        auto for_each_block(Function function) -> void_t;
+
+    private:
+        static constexpr u64_t magic = 0x6d70612d66696c65;
+
+        struct header_t
+        {
+            u64_t magic;
+            void_t* base;
+            size_t capacity;
+            // Offset past the last block handed out.
+            size_t end;
+            // Deallocated blocks, linked through their first bytes.
+            void_t* free_blocks;
+            alignas(cache_line_size) u8_t root[root_size];
+        };
+
+        struct free_block_t
+        {
+            void_t* next;
+            size_t size;
+        };
+
+        // Size of the block starting at every page, zero where none does.
+        auto directory() const -> size_t*;
+
+        header_t* header = nullptr;
+        int fd = -1;
+        bool_t existed = false;
+        mutex_t mutex;
+    };
+
+    // Blocks carved from a mapped_file_t. A multi_pool_t constructed with it in place of an earlier one,
+    // at the same address inside the file, adopts the blocks that earlier one left.
+    struct mapped_file_block_provider_t
+    {
+        explicit mapped_file_block_provider_t(mapped_file_t& file) noexcept;
+
+        auto allocate(size_t size, size_t alignment) -> void_t*;
+        auto deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t;
+        auto decommit(void_t* ptr, size_t size) -> bool_t;
+        auto commit(void_t* ptr, size_t size) -> void_t;
+        template <typename Function>
+        auto for_each_block(Function function) -> void_t;
+
+        mapped_file_t* file;
+    };
+#endif
+
+
+    template <typename T, typename WordType = u64_t>
+        requires std::unsigned_integral<WordType>
+    struct pool_t
+    {
+        using word_type = WordType;
+        alignas(cache_line_size) word_type unused_words;
+        static constexpr u32_t word_bits = sizeof(WordType) * 8;
+        static constexpr u32_t pool_size = word_bits * word_bits;
+        word_type unallocated_slots[word_bits];
+        // Starts on a fresh cache line, or on a stricter boundary for over-aligned T.
+        alignas(std::max(cache_line_size, alignof(T))) T data[pool_size];
+
+        auto init() -> void_t;
+        auto allocate() -> T*;
+        auto deallocate(T* ptr) -> void_t;
+        auto full() -> bool_t;
+        // Takes the first free slot at or after hint in its word, else the last one before it, else any.
+        auto allocate_near(const T* hint) -> T*;
+        // Takes count adjacent free slots of one word, count <= word_bits. Returns nullptr if no word has a run
+        // that long.
+        auto allocate_contiguous(u32_t count) -> T*;
+        auto deallocate_contiguous(T* ptr, u32_t count) -> void_t;
+        // Allocates up to count slots into out and returns how many were allocated.
+        auto allocate_bulk(T** out, size_t count) -> size_t;
+        // Frees count slots of this pool. Slots sharing a word are returned with a single write when adjacent in ptrs.
+        auto deallocate_bulk(T* const* ptrs, size_t count) -> void_t;
+    };
+
+    // Same layout as pool_t, but allocate and deallocate are lock free and may be called concurrently.
+    // A set bit in unused_words means the word may have free slots, it is cleared lazily by allocate.
+    // allocate returns nullptr when no free slot is found.
+    template <typename T, typename WordType = u64_t>
+        requires std::unsigned_integral<WordType>
+    struct concurrent_pool_t
+    {
+        using word_type = WordType;
+        // Every thread touches unused_words, so it gets a cache line of its own.
+        alignas(cache_line_size) std::atomic<word_type> unused_words;
+        static constexpr u32_t word_bits = sizeof(WordType) * 8;
+        static constexpr u32_t pool_size = word_bits * word_bits;
+        alignas(cache_line_size) std::atomic<word_type> unallocated_slots[word_bits];
+        alignas(std::max(cache_line_size, alignof(T))) T data[pool_size];
+
+        auto init() -> void_t;
+        auto allocate() -> T*;
+        auto deallocate(T* ptr) -> void_t;
+        auto full() -> bool_t;
+        auto clear_unused_word(u32_t bucket) -> void_t;
+    };
+
+}
+
+
+namespace mpa::impl
+{
+    // Number of pool_t<T, WordType> fitting in a block of at most MaxBlockSize bytes, capped at 64.
+    template <typename T, typename WordType, size_t MaxBlockSize>
+    constexpr auto pools_fitting() -> size_t
+    {
+        using pool_type = pool_t<T, WordType>;
+        auto pools_offset = align_up(sizeof(block_header_t), alignof(pool_type));
+        if (pools_offset + sizeof(pool_type) > MaxBlockSize)
+        {
+            return 0;
+        }
+        return std::min(size_t(64), (MaxBlockSize - pools_offset) / sizeof(pool_type));
+    }
+
+    template <typename T, typename WordType, size_t MaxBlockSize>
+    constexpr auto bytes_fitting() -> size_t
+    {
+        return pools_fitting<T, WordType, MaxBlockSize>() * sizeof(pool_t<T, WordType>);
+    }
+
+    template <typename T, size_t MaxBlockSize>
+    struct adaptive_geometry_of
+    {
+        // Wider words win ties, they scan fewer words per slot.
+        static constexpr size_t fill64 = bytes_fitting<T, u64_t, MaxBlockSize>();
+        static constexpr size_t fill32 = bytes_fitting<T, u32_t, MaxBlockSize>();
+        static constexpr size_t fill16 = bytes_fitting<T, u16_t, MaxBlockSize>();
+        static constexpr size_t fill8 = bytes_fitting<T, u8_t, MaxBlockSize>();
+
+        using word_type =
+            std::conditional_t<fill64 >= std::max({ fill32, fill16, fill8 }) && fill64, u64_t,
+            std::conditional_t<fill32 >= std::max(fill16, fill8) && fill32, u32_t,
+            std::conditional_t<fill16 >= fill8 && fill16, u16_t, u8_t>>>;
+
+        static constexpr u32_t pools_in_block = u32_t(std::max(size_t(1), pools_fitting<T, word_type, MaxBlockSize>()));
+    };
+}
+
+
+namespace mpa
+{
+    // Geometry policies choose, per T, the bitmap word of the pools (word_type<T>) and the number of pools in a
+    // block (pools_in_block<T>, at most 64).
+
+    // The same geometry for every T.
+    template <typename WordType, u32_t PoolsInBlock>
+        requires std::unsigned_integral<WordType> && (PoolsInBlock >= 1 && PoolsInBlock <= 64)
+    struct fixed_geometry_t
+    {
+        template <typename T>
+        using word_type = WordType;
+
+        template <typename T>
+        static constexpr u32_t pools_in_block = PoolsInBlock;
+    };
+
+    // Picks the word type and pool count whose block fills the most of MaxBlockSize without exceeding it.
+    // With the default a block and its power of two span fit in one 2 MiB huge page. T too large for that
+    // gets a single pool of u8_t words.
+    template <size_t MaxBlockSize = size_t(1) << 21>
+    struct adaptive_geometry_t
+    {
+        template <typename T>
+        using word_type = typename impl::adaptive_geometry_of<T, MaxBlockSize>::word_type;
+
+        template <typename T>
+        static constexpr u32_t pools_in_block = impl::adaptive_geometry_of<T, MaxBlockSize>::pools_in_block;
+    };
+
+    // Event counters of a multi_pool_t. They stay zero unless MPA_STATS is enabled.
+    struct pool_counters_t
+    {
+        u64_t allocations = 0;
+        u64_t deallocations = 0;
+        // Part of deallocations that were queued by other threads.
+        u64_t remote_deallocations = 0;
+        u64_t blocks_created = 0;
+        u64_t blocks_released = 0;
+        u64_t live_slots = 0;
+        u64_t peak_live_slots = 0;
+        // How often allocator_t found the mutex of its shared pool taken and how long it waited in total.
+        u64_t lock_waits = 0;
+        u64_t lock_wait_ns = 0;
+        // How often allocator_t took the mutex and for how long it held it in total, estimated from every
+        // 64th hold.
+        u64_t lock_acquisitions = 0;
+        u64_t lock_hold_ns = 0;
+    };
+
+    // Snapshot returned by multi_pool_t::stats().
+    struct pool_stats_t
+    {
+        pool_counters_t counters;
+        size_t blocks = 0;
+        size_t empty_blocks = 0;
+        size_t decommitted_blocks = 0;
+        // Slots in one block.
+        size_t block_capacity = 0;
+        // Live slots of every block divided by block_capacity, in block order.
+        vector_t<double> block_occupancy;
+    };
+
+    enum class trace_op_t : u8_t
+    {
+        allocate,
+        deallocate
+    };
+
+    // One allocator_t call recorded with MPA_TRACE. A trace file is a sequence of chunks, each a
+    // trace_chunk_t followed by count records of one thread in the order they were made.
+    struct trace_record_t
+    {
+        // Nanoseconds since start_trace.
+        u64_t time;
+        u64_t address;
+        // sizeof(T) * n of the call.
+        u32_t size;
+        u16_t alignment;
+        trace_op_t op;
+        u8_t reserved;
+    };
+
+    struct trace_chunk_t
+    {
+        // Threads are numbered in the order they first recorded.
+        u32_t thread;
+        u32_t count;
+    };
+
+    enum class trim_t
+    {
+        // Free empty blocks.
+        release,
+        // Keep empty blocks but give their pages back to the system.
+        decommit
+    };
+
+    enum class placement_t
+    {
+        // Take the lowest free slot of the lowest block with free slots.
+        lowest_address,
+        // Reuse the slot freed last while it is still cache hot, otherwise fall back to lowest_address.
+        recently_freed,
+        // Take the lowest free slot of the fullest block with free slots, judged by occupancy buckets. Sparse
+        // blocks get no new objects while fuller ones have room, so they drain and can be released.
+        fullest_block,
+        // Keep freed slots on a LIFO list threaded through the slots and hand them out again without touching
+        // the bitmaps, otherwise fall back to lowest_address. The list is flushed to the bitmaps when it is
+        // full and by trim. Types smaller than a pointer use lowest_address.
+        free_list
+    };
+
+    // Where a block lives and how full it is, see multi_pool_t::sparse_blocks.
+    struct block_info_t
+    {
+        const void_t* begin;
+        const void_t* end;
+        size_t live_slots;
+        double occupancy;
+    };
+
+    template <typename T, typename BlockProvider = heap_block_provider_t, typename Geometry = adaptive_geometry_t<>,
+        placement_t Placement = placement_t::lowest_address>
+    class multi_pool_t
+    {
+    public:
+        using value_type = T;
+
+        // Largest n served from the pools, as a run of adjacent slots in one bitmap word. Larger arrays come
+        // from operator new.
+        static constexpr size_t max_contiguous = pool_t<T, typename Geometry::template word_type<T>>::word_bits;
+
+        multi_pool_t();
+        explicit multi_pool_t(const BlockProvider& provider);
+        ~multi_pool_t();
         auto allocate(size_t n) -> T*;
-        auto deallocate(T* ptr, size_t n) noexcept -> void_t;
+        auto deallocate(T* ptr, size_t n) -> void_t;
+        auto allocate_bulk(T** out, size_t count) -> void_t;
+        auto deallocate_bulk(T* const* ptrs, size_t count) -> void_t;
+        // Allocates a slot as close as possible to hint: in its word of slots, else its pool, else its block.
+        // hint must be null or a live object allocated inside a block of a multi_pool_t<T> of this type. Arrays
+        // longer than max_contiguous come from operator new, outside of any block, and are not valid hints.
+        auto allocate_near(const void_t* hint) -> T*;
+
+        // Returns the multi_pool_t that allocated ptr.
+        static auto owner_of(const T* ptr) -> multi_pool_t*;
+        // Frees ptr from a thread that does not own its multi_pool_t. The slot is queued on its block and
+        // returned to the bitmaps by the owner's next call to collect_remote.
+        static auto deallocate_remote(T* ptr, size_t n) -> void_t
+            requires (sizeof(T) >= sizeof(void_t*));
+        // Returns all slots queued by deallocate_remote. Cheap when nothing is queued.
+        auto collect_remote() -> void_t;
+        // Returns the slots on the free list of placement_t::free_list to the bitmaps. Until then they count as
+        // live in the block occupancy of stats, sparse_blocks and occupancy_of, and keep their blocks from being
+        // released.
+        auto flush() -> void_t;
+
+        // Number of empty blocks to keep before deallocate starts releasing them.
+        auto set_retained_empty_blocks(size_t count) -> void_t;
+        // Releases or decommits empty blocks until at most retain of them are left. Returns the number of
+        // blocks trimmed.
+        auto trim(size_t retain = 0, trim_t mode = trim_t::release) -> size_t;
+        // Frees every slot at once without running destructors, remote frees still queued are dropped. Takes
+        // one pass over the blocks, which are kept for reuse until trimmed. Arrays longer than max_contiguous
+        // are not part of any block and still have to be deallocated.
+        auto reset() -> void_t;
+        // Counters and block occupancy, linear in the number of blocks.
+        auto stats() const -> pool_stats_t;
+        // Blocks with live objects that are at most max_occupancy full. Moving their objects elsewhere, e.g. by
+        // rebuilding a container, lets them be released.
+        auto sparse_blocks(double max_occupancy) const -> vector_t<block_info_t>;
+        // Occupancy of the block holding ptr, for deciding per object whether to move it.
+        auto occupancy_of(const T* ptr) const -> double;
+
+    private:
+        using pool_type = pool_t<T, typename Geometry::template word_type<T>>;
+        using block_type = impl::block_t<u64_t>;
+
+        static constexpr u32_t pools_in_block = Geometry::template pools_in_block<T>;
+        static_assert(pools_in_block >= 1 && pools_in_block <= 64);
+        // unmaxed_pools of a block where every pool has free slots.
+        static constexpr u64_t all_pools = ~u64_t(0) >> (64 - pools_in_block);
+
+        // Pools are cache line aligned, so the block header written by remote frees sits on its own line.
+        static constexpr size_t pools_offset = impl::align_up(sizeof(impl::block_header_t), alignof(pool_type));
+        static constexpr size_t block_size = pools_offset + sizeof(pool_type) * pools_in_block;
+        static constexpr size_t block_alignment = std::bit_ceil(block_size);
+        static constexpr size_t slots_in_block = size_t(pools_in_block) * pool_type::pool_size;
+
+        // Unmaxed blocks are tracked per occupancy bucket: empty blocks, then thirds of slots_in_block.
+        static constexpr u32_t occupancy_buckets = Placement == placement_t::fullest_block ? 4 : 1;
+        static auto occupancy_bucket(u32_t live_slots) -> u32_t;
+
+        static auto pools_of(const block_type& memory_block) -> pool_type*;
+        // Pool pool_idx of memory_block, initialized if this is its first use.
+        static auto use_pool(block_type& memory_block, u32_t pool_idx) -> pool_type*;
+
+        // Blocks are grouped by node only when the block provider reports nodes.
+        static constexpr bool_t numa_aware = requires (BlockProvider& provider)
+        {
+            { provider.current_node() } -> std::convertible_to<u32_t>;
+        };
+
+        // The memory of persistent block providers outlives the process, the pool takes over the blocks of
+        // the previous run when it is constructed.
+        static constexpr bool_t persistent = requires (BlockProvider& provider)
+        {
+            provider.for_each_block([](void_t*, size_t) {});
+        };
+
+        auto current_node() -> u32_t;
+        // Bits of the unmaxed blocks of the node and occupancy bucket of memory_blocks[block_idx].
+        auto unmaxed_blocks_of(size_t block_idx) -> impl::bit_tree_t<u64_t>&;
+        // Moves the block to the bucket matching its live slots.
+        auto update_bucket(size_t block_idx) -> void_t;
+        auto new_block(u32_t node) -> void_t;
+        auto count_allocations(size_t n) -> void_t;
+        auto count_deallocations(size_t n) -> void_t;
+        auto release_block(size_t block_idx) -> void_t;
+        // Index of a committed block with free slots, creating one if there is none.
+        auto unmaxed_block() -> size_t;
+        auto allocate_lowest() -> T*;
+        // Moves the cursor down to block_idx after slots of it were freed, if that block is now the lowest one
+        // with free slots.
+        auto lower_cursor(size_t block_idx) -> void_t;
+        // Frees count slots given in ascending address order, as deallocate_bulk does after sorting them.
+        auto deallocate_sorted(T* const* sorted, size_t count) -> void_t;
+        // Allocates from pool pool_idx of block block_idx, which must have free slots. A non-null hint must
+        // point into that pool.
+        auto allocate_from(size_t block_idx, u32_t pool_idx, const T* hint) -> T*;
+        // Allocates n > 1 adjacent slots, from the pools when n <= max_contiguous.
+        auto allocate_run(size_t n) -> T*;
+        // Bits of the blocks of node whose run_bound is at least n, 2 <= n <= max_contiguous.
+        auto run_blocks_of(u32_t node, size_t n) -> impl::bit_tree_t<u64_t>&;
+        // Adds the block to the run trees of every length after slots of it were freed.
+        auto raise_run_bound(size_t block_idx) -> void_t;
+        // Removes the block from the run trees of n and longer lengths, after no run of n was found in it.
+        auto lower_run_bound(size_t block_idx, size_t n) -> void_t;
+        // Takes a run of n slots from block block_idx, or returns nullptr if none of its pools has one. Pools
+        // from first_pool on are tried first.
+        auto allocate_run_from(size_t block_idx, size_t n, u32_t first_pool) -> T*;
+        // Commits the pages of a decommitted block again.
+        auto commit_block(size_t block_idx) -> void_t;
+        // Copies initialized_pools to the block header when the block provider is persistent.
+        static auto persist_initialized_pools(const block_type& memory_block) -> void_t;
+        // Rebuilds memory_blocks from the blocks of the provider whose header names this pool as owner.
+        auto adopt_blocks() -> void_t;
+        // Returns n slots starting at ptr to the bitmaps.
+        auto free_slots(T* ptr, size_t n) -> void_t;
+        // Aborts unless ptr starts a run of n allocated slots of this pool that are not on the free list. Only
+        // used with MPA_HARDENED. Reads the block header ptr would have, so ptr must point to readable memory.
+        auto check_allocated(const T* ptr, size_t n) -> void_t;
+
+        static constexpr bool_t uses_free_list = Placement == placement_t::free_list && sizeof(T) >= sizeof(void_t*);
+        static constexpr u32_t free_list_capacity = MPA_FREE_LIST_SIZE;
+
+        [[no_unique_address]] BlockProvider block_provider;
+        vector_t<block_type> memory_blocks;
+        // Committed blocks without live slots.
+        size_t empty_blocks = 0;
+        size_t retained_empty_blocks = MPA_RETAINED_EMPTY_BLOCKS;
+        // Slots deallocate_bulk sorts at once, in a buffer on the stack so freeing never allocates.
+        static constexpr size_t bulk_chunk = 256;
+        pool_counters_t counters;
+        // One bit per block that still has a pool with free slots, in the tree of the block's node and
+        // occupancy bucket, at node * occupancy_buckets + bucket.
+        vector_t<impl::bit_tree_t<u64_t>> unmaxed_blocks;
+        // One tree per node and run length n from 2 to max_contiguous, at node * run_lengths + n - 2, with a bit
+        // for every block of the node whose run_bound is at least n.
+        static constexpr size_t run_lengths = max_contiguous - 1;
+        vector_t<impl::bit_tree_t<u64_t>> run_blocks;
+        // Blocks with a non-empty remote_frees list.
+        std::atomic<impl::block_header_t*> remote_blocks = nullptr;
+        // Slot freed last by deallocate, reset when blocks are trimmed. Only used by placement_t::recently_freed.
+        T* recently_freed = nullptr;
+        // Lowest block of node cursor_node with free slots and its lowest pool with free slots, so allocate()
+        // takes the next slot without searching unmaxed_blocks. Allocations only fill slots and never move the
+        // lowest free one down, frees lower the cursor, anything renumbering or decommitting blocks invalidates
+        // it (sets cursor_block to npos). Not used with occupancy buckets, which change the order.
+        size_t cursor_block = impl::bit_tree_t<u64_t>::npos;
+        u32_t cursor_pool = 0;
+        u32_t cursor_node = 0;
+        // Block and pool the last run was taken from, where allocate_run starts looking for the next one.
+        size_t run_block = 0;
+        u32_t run_pool = 0;
+        // Freed slots not yet returned to the bitmaps, linked through their first bytes. Only used by
+        // placement_t::free_list.
+        T* free_list = nullptr;
+        u32_t free_list_length = 0;
+    };
+}
+
+
+namespace mpa::impl
+{
+    // Mutex that, with MPA_STATS enabled, counts how often lock had to wait and for how long. Waiting is
+    // detected through a relaxed flag set while the mutex is held, which is cheaper than a try_lock on every
+    // call but makes the counts approximate. Only every hold_sample_interval-th hold is timed, and hold_ns
+    // extrapolates from those. The counts are written with the mutex held and must only be read with it held.
+    class counting_mutex_t
+    {
+    public:
+        auto lock() -> void_t;
+        auto unlock() -> void_t;
+        auto try_lock() -> bool_t;
+
+        u64_t waits = 0;
+        u64_t wait_ns = 0;
+        u64_t acquisitions = 0;
+        u64_t hold_ns = 0;
+
+    private:
+        static constexpr u64_t hold_sample_interval = 64;
+
+        auto lock_contended() -> void_t;
+        auto acquired() -> void_t;
+
+        mutex_t mutex;
+        std::atomic<bool_t> held = false;
+        // Start of the hold being timed, zero when the current hold is not sampled.
+        std::chrono::steady_clock::time_point hold_start = {};
+    };
+
+
+    // Event counters with one cache line per thread, so counting never shares a line between threads. A thread
+    // only writes its own shard, with relaxed loads and stores rather than read-modify-writes, and sum adds up
+    // all shards. The shards of exited threads are handed to new threads, so no counts are lost. Every Tag
+    // gets a separate set of shards.
+    template <typename Tag, size_t Count>
+    class sharded_counters_t
+    {
+    public:
+        static auto add(size_t counter, u64_t n) -> void_t;
+        static auto sum(size_t counter) -> u64_t;
+
+    private:
+        struct alignas(cache_line_size) shard_t
+        {
+            std::atomic<u64_t> counters[Count];
+        };
+
+        struct shard_handle_t
+        {
+            ~shard_handle_t();
+
+            shard_t* shard = nullptr;
+        };
+
+        static auto acquire_shard() -> shard_t*;
+
+        inline static mutex_t mutex;
+        inline static vector_t<std::unique_ptr<shard_t>> shards;
+        inline static vector_t<shard_t*> free_shards;
+        // Counts of threads that already gave their shard back, added with read-modify-writes.
+        inline static shard_t exited_shard;
+        // Trivially destructible, so the hot path reads it without a TLS init guard. handle gives the shard
+        // back when the thread exits, later counts of the thread go to exited_shard.
+        inline static thread_local shard_t* local_shard = nullptr;
+        inline static thread_local bool_t exited = false;
+        inline static thread_local shard_handle_t handle;
+    };
+
+
+    // release_blocks of every shared_pool_t initialized so far, called by shutdown.
+    inline mutex_t shared_pools_mutex;
+    inline vector_t<auto (*)() -> size_t> shared_pool_releases;
+
+
+    // The pool behind allocator_t, one per storage type and shared by all threads behind a mutex. It is
+    // constructed in place in static storage the first time init runs, so allocate and deallocate use a
+    // constant address instead of loading a pointer. It is never destroyed: statics destroyed after it may
+    // still free into it. At exit only its empty blocks are released.
+    template <typename Storage>
+    class shared_pool_t
+    {
+    public:
+        // Thread safe, the pool is constructed once.
+        static auto init() -> void_t;
+        static auto allocate(size_t n) -> Storage*;
+        static auto deallocate(Storage* ptr, size_t n) -> void_t;
+        static auto allocate_bulk(Storage** out, size_t count) -> void_t;
+        static auto deallocate_bulk(Storage* const* ptrs, size_t count) -> void_t;
+        static auto trim(size_t retain, trim_t mode) -> size_t;
+        static auto stats() -> pool_stats_t;
+        // Returns the slots of the caches of all threads to the pool and releases every empty block. No other
+        // thread may use the pool meanwhile.
+        static auto release() -> size_t;
+
+    private:
+        static constexpr u32_t thread_cache_size = MPA_THREAD_CACHE_SIZE;
+        static constexpr u32_t thread_cache_batch = thread_cache_size / 2 ? thread_cache_size / 2 : 1;
+
+        // Stack of free slots owned by one thread. It is refilled from and flushed to the shared pool in
+        // batches, so only one in thread_cache_batch operations takes the mutex. Slots freed by a thread
+        // other than the one that allocated them simply join this thread's cache or flush to the shared pool.
+        // The caches of all threads are linked, so release can empty them.
+        struct thread_cache_t
+        {
+            thread_cache_t();
+            ~thread_cache_t();
+
+            u32_t count = 0;
+            std::array<Storage*, thread_cache_size> slots;
+            thread_cache_t* previous = nullptr;
+            thread_cache_t* next = nullptr;
+        };
+
+        // Constructs the pool, its destructor runs at exit and releases the empty blocks.
+        struct lifetime_t
+        {
+            lifetime_t();
+            ~lifetime_t();
+        };
+
+        using pool_type = multi_pool_t<Storage, MPA_BLOCK_PROVIDER, MPA_GEOMETRY, MPA_PLACEMENT>;
+
+        static auto pool() -> pool_type*;
+        static auto release_blocks() -> size_t;
+
+        alignas(pool_type) inline static constinit std::byte storage[sizeof(pool_type)] = {};
+        inline static counting_mutex_t mutex;
+        inline static thread_cache_t* thread_caches = nullptr;
+        // Trivially destructible, so thread_local destructors that run after thread_cache allocate from and
+        // free to the shared pool instead of a cache nobody empties again.
+        inline static thread_local bool_t exited = false;
+        inline static thread_local thread_cache_t thread_cache;
+
+        // Calls of allocate and deallocate, counted outside the mutex and including thread cache hits.
+        enum counter_t : size_t
+        {
+            allocations,
+            deallocations,
+            counter_count
+        };
+
+        using counters = sharded_counters_t<shared_pool_t, counter_count>;
+    };
+
+
+    // Recorder behind MPA_TRACE. Every thread fills buffers of its own, and a writer thread appends the full
+    // ones to the file, so recording takes no lock except when a buffer is swapped.
+    class tracer_t
+    {
+    public:
+        static auto start(const char* path) -> bool_t;
+        static auto stop() -> void_t;
+        static auto record(trace_op_t op, const void_t* ptr, size_t size, size_t alignment) -> void_t;
+
+    private:
+        static constexpr u32_t buffer_records = 4096;
+
+        struct buffer_t
+        {
+            trace_chunk_t chunk;
+            trace_record_t records[buffer_records];
+        };
+
+        // The buffers of all threads are linked, so stop can write the partly filled ones.
+        struct thread_buffer_t
+        {
+            thread_buffer_t();
+            ~thread_buffer_t();
+
+            u32_t thread;
+            buffer_t* buffer = nullptr;
+            thread_buffer_t* previous = nullptr;
+            thread_buffer_t* next = nullptr;
+        };
+
+        // Queues buffer for the writer and returns an empty one, both with the mutex held.
+        static auto swap_buffer(buffer_t* buffer, u32_t thread) -> buffer_t*;
+        // Queues buffer for the writer without taking an empty one, with the mutex held.
+        static auto queue_buffer(buffer_t* buffer) -> void_t;
+        static auto write_buffers() -> void_t;
+
+        inline static std::atomic<bool_t> active = false;
+        inline static bool_t stopping = false;
+        inline static FILE* file = nullptr;
+        inline static std::chrono::steady_clock::time_point start_time;
+        inline static u32_t thread_count = 0;
+        inline static mutex_t mutex;
+        inline static std::condition_variable buffers_written;
+        inline static vector_t<buffer_t*> full_buffers;
+        inline static vector_t<std::unique_ptr<buffer_t>> buffers;
+        inline static vector_t<buffer_t*> spare_buffers;
+        inline static thread_buffer_t* thread_buffers = nullptr;
+        inline static std::thread writer;
+        // Trivially destructible, so records made by thread_local destructors running after thread_buffer
+        // are dropped instead of written to a buffer the thread gave away.
+        inline static thread_local bool_t exited = false;
+        inline static thread_local thread_buffer_t thread_buffer;
+    };
+
+
+    // The heaps behind thread_heap_allocator_t, one set per storage type.
+    template <typename Storage>
+    class thread_heaps_t
+    {
+    public:
+        static auto allocate(size_t n) -> Storage*;
+        static auto deallocate(Storage* ptr, size_t n) -> void_t;
+
+    private:
+        using heap_t = multi_pool_t<Storage, MPA_BLOCK_PROVIDER, MPA_GEOMETRY, MPA_PLACEMENT>;
+
+        // Parks the heap of the thread when it exits.
+        struct heap_handle_t
+        {
+            ~heap_handle_t();
+        };
+
+        static auto local_heap() -> heap_t*;
+
+        inline static mutex_t mutex;
+        inline static vector_t<heap_t*> abandoned_heaps;
+        // Trivially destructible, so thread_local destructors that run after handle still see that the heap
+        // is gone: their frees take deallocate_remote and their allocations borrow a parked heap.
+        inline static thread_local heap_t* thread_heap = nullptr;
+        inline static thread_local bool_t exited = false;
+        inline static thread_local heap_handle_t handle;
+    };
+}
+
+
+namespace mpa
+{
+    template <typename T>
+    class allocator_t
+    {
+    public:
+        using value_type = T;
+        using size_type = size_t;
+        using difference_type = ptrdiff_t;
+        using propagate_on_container_move_assignment = std::false_type;
+        using propagate_on_container_copy_assignment = std::false_type;
+
+        template <typename U>
+        struct rebind
+        {
+            using other = allocator_t<U>;
+        };
+
+        allocator_t() noexcept;
+
+        template <typename U>
+        allocator_t(const allocator_t<U>& other) noexcept
+        {
+            shared_pool::init();
+        }
+
+        [[nodiscard]]
+        auto allocate(size_t n) -> T*;
+        auto deallocate(T* ptr, size_t n) noexcept -> void_t;
+        // Allocate or free count single objects under one lock, see multi_pool_t::allocate_bulk.
+        auto allocate_bulk(T** out, size_t count) -> void_t;
+        auto deallocate_bulk(T* const* ptrs, size_t count) noexcept -> void_t;
+
+        // Flushes the calling thread's cache and trims the shared pool, see multi_pool_t::trim.
+        static auto trim(size_t retain = 0, trim_t mode = trim_t::release) -> size_t;
+        // Stats of the shared pool, see multi_pool_t::stats. allocations and deallocations count the calls of
+        // all allocator_t<T>, the other counters are those of the pool, where slots in thread caches are live.
+        static auto stats() -> pool_stats_t;
+
+    private:
+        using storage_type = impl::storage_t<T>;
+        using shared_pool = impl::shared_pool_t<storage_type>;
+    };
+
+
+    // Releases every block of the pool behind allocator_t<T> that has no live objects, including slots held
+    // in the caches of other threads, and returns the number of blocks released. With MPA_SIZE_CLASSES the
+    // pool is shared by all types of the size class. No other thread may use the pool while it runs, e.g.
+    // call it between the stages of a batch job.
+    template <typename T>
+    auto release_all() -> size_t;
+
+    // release_all for every allocator_t pool used so far.
+    auto shutdown() -> size_t;
+
+    // With MPA_TRACE, starts recording the calls of every allocator_t to path. Returns false if the file
+    // cannot be created or a trace is already running.
+    auto start_trace(const char* path) -> bool_t;
+    // Writes what is left of the trace and closes the file. No other thread may allocate meanwhile.
+    auto stop_trace() -> void_t;
+
+
+    // Stateless allocator where every thread allocates from a multi_pool_t of its own without locking.
+    // Slots freed by the owning thread go straight to the bitmaps, slots freed by other threads are queued
+    // on their block and collected by the owner on its next allocation. The heap of an exited thread is
+    // handed to the next new thread, together with whatever was freed into it in the meantime.
+    template <typename T>
+    class thread_heap_allocator_t
+    {
+    public:
+        using value_type = T;
+        using size_type = size_t;
+        using difference_type = ptrdiff_t;
+        using propagate_on_container_move_assignment = std::false_type;
+        using propagate_on_container_copy_assignment = std::false_type;
+        using is_always_equal = std::true_type;
+
+        template <typename U>
+        struct rebind
+        {
+            using other = thread_heap_allocator_t<U>;
+        };
+
+        thread_heap_allocator_t() noexcept = default;
+
+        template <typename U>
+        thread_heap_allocator_t(const thread_heap_allocator_t<U>& other) noexcept
+        {
+        }
+
+        [[nodiscard]]
+        auto allocate(size_t n) -> T*;
+        auto deallocate(T* ptr, size_t n) noexcept -> void_t;
+
+    private:
+        using storage_type = impl::heap_storage_t<T>;
+        using thread_heaps = impl::thread_heaps_t<storage_type>;
+    };
+
+    template <typename T, typename U>
+    auto operator==(const thread_heap_allocator_t<T>& a, const thread_heap_allocator_t<U>& b) noexcept -> bool_t;
+
+
+    // std::pmr::memory_resource that serves requests of up to max_pooled_size bytes from one multi_pool_t per size
+    // class and passes larger or over-aligned requests to the upstream resource. Like
+    // std::pmr::unsynchronized_pool_resource it must not be used by several threads at once.
+    template <typename BlockProvider = MPA_BLOCK_PROVIDER>
+    class basic_pool_resource_t : public std::pmr::memory_resource
+    {
+    public:
+        static constexpr size_t max_pooled_size = 1024;
+
+        basic_pool_resource_t() noexcept;
+        explicit basic_pool_resource_t(std::pmr::memory_resource* upstream) noexcept;
+        // Every size class pool gets a copy of provider. With a persistent provider the resource constructed
+        // in place of the one of an earlier run takes over its pools, see mapped_file_block_provider_t. Only
+        // the pooled requests persist, so containers kept in a file must be node based, e.g. std::map.
+        explicit basic_pool_resource_t(const BlockProvider& provider,
+            std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+
+        auto upstream_resource() const noexcept -> std::pmr::memory_resource*;
+        // Trims the pool of every size class, see multi_pool_t::trim.
+        auto trim(size_t retain = 0, trim_t mode = trim_t::release) -> size_t;
+        // Frees everything allocated from the size class pools at once, see multi_pool_t::reset. Requests
+        // passed upstream are not tracked and still have to be deallocated.
+        auto reset() -> void_t;
+
+        // Like allocate and deallocate for n objects of type T, without the virtual call. Single objects go
+        // straight to the pool of their size class, which is picked at compile time.
+        template <typename T>
+        auto allocate_object(size_t n = 1) -> T*;
+        template <typename T>
+        auto deallocate_object(T* ptr, size_t n = 1) -> void_t;
+
+    protected:
+        auto do_allocate(size_t bytes, size_t alignment) -> void_t* override;
+        auto do_deallocate(void_t* ptr, size_t bytes, size_t alignment) -> void_t override;
+        auto do_is_equal(const std::pmr::memory_resource& other) const noexcept -> bool_t override;
+
+    private:
+        static constexpr size_t class_count = impl::size_class_index(max_pooled_size) + 1;
+        using class_indices = std::make_index_sequence<class_count>;
+
+        template <size_t Index, size_t Class = impl::size_class_of_index(Index)>
+        using class_pool_t = multi_pool_t<impl::slot_t<Class, impl::size_class_alignment(Class)>, BlockProvider,
+            MPA_GEOMETRY, MPA_PLACEMENT>;
+
+        template <typename Indices>
+        struct pools_of_t;
+
+        template <size_t... Indices>
+        struct pools_of_t<std::index_sequence<Indices...>>
+        {
+            using type = std::tuple<class_pool_t<Indices>...>;
+        };
+
+        using pools_type = typename pools_of_t<class_indices>::type;
+
+        template <size_t... Indices>
+        basic_pool_resource_t(const BlockProvider& provider, std::pmr::memory_resource* upstream, std::index_sequence<Indices...>);
+
+        static constexpr auto pooled(size_t bytes, size_t alignment) -> bool_t;
+
+        template <size_t... Indices>
+        auto allocate_pooled(size_t index, std::index_sequence<Indices...>) -> void_t*;
+        template <size_t... Indices>
+        auto deallocate_pooled(void_t* ptr, size_t index, std::index_sequence<Indices...>) -> void_t;
+
+        std::pmr::memory_resource* upstream;
+        pools_type pools;
+    };
+
+    using pool_resource_t = basic_pool_resource_t<>;
+
+
+    // Stateful allocator over a pool_resource_t (or another instance of basic_pool_resource_t) owned by the user,
+    // e.g. one per container or per request, so nothing is shared and nothing is locked. Rebound copies use the same
+    // resource, whose size class pools serve the node types of containers. Allocators compare equal when they use the
+    // same resource. With Propagate the resource follows the contents on container copy and move assignment and swap,
+    // so moves are constant time. Without it every container stays on its resource, like std::pmr, and assigning
+    // between containers of different resources moves element by element.
+    template <typename T, bool_t Propagate = true, typename Resource = pool_resource_t>
+    class pool_allocator_t
+    {
+    public:
+        using value_type = T;
+        using size_type = size_t;
+        using difference_type = ptrdiff_t;
+        using propagate_on_container_copy_assignment = std::bool_constant<Propagate>;
+        using propagate_on_container_move_assignment = std::bool_constant<Propagate>;
+        using propagate_on_container_swap = std::bool_constant<Propagate>;
+        using is_always_equal = std::false_type;
+
+        template <typename U>
+        struct rebind
+        {
+            using other = pool_allocator_t<U, Propagate, Resource>;
+        };
+
+        pool_allocator_t(Resource* resource) noexcept;
+
+        template <typename U>
+        pool_allocator_t(const pool_allocator_t<U, Propagate, Resource>& other) noexcept :
+            pool(other.resource())
+        {
+        }
+
+        [[nodiscard]]
+        auto allocate(size_t n) -> T*;
+        auto deallocate(T* ptr, size_t n) noexcept -> void_t;
+
+        auto resource() const noexcept -> Resource*;
+
+    private:
+        Resource* pool;
+    };
+
+    template <typename T, typename U, bool_t Propagate, typename Resource>
+    auto operator==(const pool_allocator_t<T, Propagate, Resource>& a, const pool_allocator_t<U, Propagate, Resource>& b) noexcept -> bool_t;
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::init() -> void_t
+    {
+        unused_words = ~WordType(0);
+
+        for (auto i = 0u; i < word_bits; ++i)
+        {
+            unallocated_slots[i] = ~WordType(0);
+        }
+        impl::poison(data, sizeof(data));
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::allocate() -> T*
+    {
+        auto bucket = impl::ctz(unused_words);
+        auto slot = impl::ctz(unallocated_slots[bucket]);
+
+        impl::clear_bit(unallocated_slots[bucket], slot);
+        if (!unallocated_slots[bucket])
+        {
+            impl::clear_bit(unused_words, bucket);
+        }
+
+        impl::unpoison(&data[bucket * word_bits + slot], sizeof(T));
+        return &data[bucket * word_bits + slot];
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::deallocate(T* ptr) -> void_t
+    {
+        auto index = uint32_t(ptr - data);
+        auto bucket = index / word_bits;
+        auto slot = index % word_bits;
+
+        if constexpr (hardened)
+        {
+            if (impl::test_bit(unallocated_slots[bucket], slot))
+            {
+                impl::report_misuse("double free");
+            }
+        }
+        impl::fill_freed(ptr, sizeof(T));
+        impl::poison(ptr, sizeof(T));
+
+        // The word has a free slot again as soon as it stops being fully allocated.
+        impl::set_bit(unallocated_slots[bucket], slot);
+        if (unallocated_slots[bucket] == WordType(WordType(1) << slot))
+        {
+            impl::set_bit(unused_words, bucket);
+        }
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::full() -> bool_t
+    {
+        return !unused_words;
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::allocate_near(const T* hint) -> T*
+    {
+        auto index = uint32_t(hint - data);
+        auto bucket = index / word_bits;
+        auto& slots = unallocated_slots[bucket];
+
+        if (!slots)
+        {
+            return allocate();
+        }
+
+        auto after = WordType(slots & WordType(WordType(~WordType(0)) << (index % word_bits)));
+        auto slot = after ? impl::ctz(after) : u32_t(word_bits - 1 - std::countl_zero(slots));
+
+        impl::clear_bit(slots, slot);
+        if (!slots)
+        {
+            impl::clear_bit(unused_words, bucket);
+        }
+
+        impl::unpoison(&data[bucket * word_bits + slot], sizeof(T));
+        return &data[bucket * word_bits + slot];
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::allocate_contiguous(u32_t count) -> T*
+    {
+        if (!unused_words)
+        {
+            return nullptr;
+        }
+
+        auto bucket = impl::find_run(unallocated_slots, unused_words, count);
+        if (bucket == word_bits)
+        {
+            return nullptr;
+        }
+
+        auto& slots = unallocated_slots[bucket];
+        auto slot = impl::ctz(impl::run_starts(slots, count));
+        slots &= WordType(~WordType(WordType(WordType(~WordType(0)) >> (word_bits - count)) << slot));
+        if (!slots)
+        {
+            impl::clear_bit(unused_words, bucket);
+        }
+
+        impl::unpoison(&data[bucket * word_bits + slot], count * sizeof(T));
+        return &data[bucket * word_bits + slot];
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::deallocate_contiguous(T* ptr, u32_t count) -> void_t
+    {
+        auto index = uint32_t(ptr - data);
+        auto bucket = index / word_bits;
+        auto slot = index % word_bits;
+
+        auto run = WordType(WordType(WordType(~WordType(0)) >> (word_bits - count)) << slot);
+        if constexpr (hardened)
+        {
+            if (unallocated_slots[bucket] & run)
+            {
+                impl::report_misuse("double free");
+            }
+        }
+        impl::fill_freed(ptr, count * sizeof(T));
+        impl::poison(ptr, count * sizeof(T));
+
+        if (!unallocated_slots[bucket])
+        {
+            impl::set_bit(unused_words, bucket);
+        }
+        unallocated_slots[bucket] |= run;
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::allocate_bulk(T** out, size_t count) -> size_t
+    {
+        auto allocated = size_t(0);
+
+        while (allocated < count && unused_words)
+        {
+            auto bucket = impl::ctz(unused_words);
+            auto& slots = unallocated_slots[bucket];
+            auto bucket_data = &data[bucket * word_bits];
+
+            if (slots == WordType(~WordType(0)) && count - allocated >= word_bits)
+            {
+                // A completely free word is taken whole, no need to look at its bits.
+                for (auto i = 0u; i < word_bits; ++i)
+                {
+                    out[allocated++] = bucket_data + i;
+                }
+                slots = 0;
+                impl::unpoison(bucket_data, word_bits * sizeof(T));
+            }
+            else
+            {
+                while (slots && allocated < count)
+                {
+                    out[allocated++] = bucket_data + impl::ctz(slots);
+                    impl::unpoison(out[allocated - 1], sizeof(T));
+                    slots &= slots - 1;
+                }
+            }
+
+            if (!slots)
+            {
+                impl::clear_bit(unused_words, bucket);
+            }
+        }
+
+        return allocated;
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto pool_t<T, WordType>::deallocate_bulk(T* const* ptrs, size_t count) -> void_t
+    {
+        for (auto i = size_t(0); i < count;)
+        {
+            auto bucket = uint32_t(ptrs[i] - data) / word_bits;
+            auto freed = WordType(0);
+
+            for (; i < count && uint32_t(ptrs[i] - data) / word_bits == bucket; ++i)
+            {
+                auto slot = uint32_t(ptrs[i] - data) % word_bits;
+                if constexpr (hardened)
+                {
+                    if (impl::test_bit(WordType(freed | unallocated_slots[bucket]), slot))
+                    {
+                        impl::report_misuse("double free");
+                    }
+                }
+                impl::fill_freed(ptrs[i], sizeof(T));
+                impl::poison(ptrs[i], sizeof(T));
+                impl::set_bit(freed, slot);
+            }
+
+            if (!unallocated_slots[bucket])
+            {
+                impl::set_bit(unused_words, bucket);
+            }
+            unallocated_slots[bucket] |= freed;
+        }
+    }
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto concurrent_pool_t<T, WordType>::init() -> void_t
+    {
+        for (auto i = 0u; i < word_bits; ++i)
+        {
+            unallocated_slots[i].store(~WordType(0), std::memory_order_relaxed);
+        }
+
+        unused_words.store(~WordType(0), std::memory_order_release);
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto concurrent_pool_t<T, WordType>::allocate() -> T*
+    {
+        for (auto words = unused_words.load(std::memory_order_acquire); words; words = unused_words.load(std::memory_order_acquire))
+        {
+            auto bucket = impl::ctz(words);
+            auto& slots_word = unallocated_slots[bucket];
+
+            for (auto slots = slots_word.load(std::memory_order_relaxed); slots;)
+            {
+                auto slot = impl::ctz(slots);
+                auto bit = WordType(WordType(1) << slot);
+                auto previous = slots_word.fetch_and(WordType(~bit), std::memory_order_acq_rel);
+
+                if (previous & bit)
+                {
+                    if (previous == bit)
+                    {
+                        clear_unused_word(bucket);
+                    }
+
+                    return &data[bucket * word_bits + slot];
+                }
+
+                slots = WordType(previous & ~bit);
+            }
+
+            clear_unused_word(bucket);
+        }
+
+        return nullptr;
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto concurrent_pool_t<T, WordType>::deallocate(T* ptr) -> void_t
+    {
+        auto index = uint32_t(ptr - data);
+        auto bucket = index / word_bits;
+        auto slot = index % word_bits;
+
+        auto previous = unallocated_slots[bucket].fetch_or(WordType(WordType(1) << slot), std::memory_order_acq_rel);
+        if constexpr (hardened)
+        {
+            if (impl::test_bit(previous, slot))
+            {
+                impl::report_misuse("double free");
+            }
+        }
+        if (!previous)
+        {
+            unused_words.fetch_or(WordType(WordType(1) << bucket), std::memory_order_acq_rel);
+        }
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto concurrent_pool_t<T, WordType>::full() -> bool_t
+    {
+        return !unused_words.load(std::memory_order_acquire);
+    }
+
+
+    template <typename T, typename WordType>
+        requires std::unsigned_integral<WordType>
+    auto concurrent_pool_t<T, WordType>::clear_unused_word(u32_t bucket) -> void_t
+    {
+        unused_words.fetch_and(WordType(~(WordType(1) << bucket)), std::memory_order_acq_rel);
+
+        // A concurrent deallocate may have refilled the word before the hint was cleared.
+        if (unallocated_slots[bucket].load(std::memory_order_acquire))
+        {
+            unused_words.fetch_or(WordType(WordType(1) << bucket), std::memory_order_acq_rel);
+        }
+    }
+
+    inline auto heap_block_provider_t::allocate(size_t size, size_t alignment) -> void_t*
+    {
+        return ::operator new(size, std::align_val_t(alignment));
+    }
+
+    inline auto heap_block_provider_t::deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t
+    {
+        ::operator delete(ptr, std::align_val_t(alignment));
+    }
+
+    inline auto heap_block_provider_t::decommit(void_t* ptr, size_t size) -> bool_t
+    {
+        return impl::decommit(ptr, size);
+    }
+
+    inline auto heap_block_provider_t::commit(void_t* ptr, size_t size) -> void_t
+    {
+    }
+
+
+    inline auto page_block_provider_t::allocate(size_t size, size_t alignment) -> void_t*
+    {
+#if defined(__unix__) || defined(__APPLE__) || defined(_WIN32)
+        auto ptr = impl::map_aligned(impl::align_up(size, impl::page_size()), std::max(alignment, impl::page_size()), 0);
+        if (!ptr)
+        {
+            throw std::bad_alloc();
+        }
+        return ptr;
+#else
+        return ::operator new(size, std::align_val_t(alignment));
+#endif
+    }
+
+    inline auto page_block_provider_t::deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        munmap(ptr, impl::align_up(size, impl::page_size()));
+#elif defined(_WIN32)
+        VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+        ::operator delete(ptr, std::align_val_t(alignment));
+#endif
+    }
+
+    inline auto page_block_provider_t::decommit(void_t* ptr, size_t size) -> bool_t
+    {
+#if defined(_WIN32)
+        auto begin = impl::align_up(uintptr_t(ptr), impl::page_size());
+        auto end = (uintptr_t(ptr) + size) & ~uintptr_t(impl::page_size() - 1);
+
+        if (begin < end)
+        {
+            VirtualFree((void_t*)begin, end - begin, MEM_DECOMMIT);
+        }
+        return true;
+#else
+        return impl::decommit(ptr, size);
+#endif
+    }
+
+    inline auto page_block_provider_t::commit(void_t* ptr, size_t size) -> void_t
+    {
+#if defined(_WIN32)
+        auto begin = impl::align_up(uintptr_t(ptr), impl::page_size());
+        auto end = (uintptr_t(ptr) + size) & ~uintptr_t(impl::page_size() - 1);
+
+        if (begin < end && !VirtualAlloc((void_t*)begin, end - begin, MEM_COMMIT, PAGE_READWRITE))
+        {
+            throw std::bad_alloc();
+        }
+#endif
+    }
+
+
+    inline auto numa_block_provider_t::allocate(size_t size, size_t alignment) -> void_t*
+    {
+        auto ptr = page_block_provider_t::allocate(size, alignment);
+        impl::bind_to_numa_node(ptr, impl::align_up(size, impl::page_size()), current_node());
+        return ptr;
+    }
+
+    inline auto numa_block_provider_t::current_node() -> u32_t
+    {
+        thread_local u32_t calls = 0;
+        thread_local u32_t node = 0;
+
+        if (calls++ % refresh_interval == 0)
+        {
+            node = impl::numa_node();
+        }
+        return node;
+    }
+
+    inline auto huge_page_block_provider_t::allocate(size_t size, size_t alignment) -> void_t*
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        size = impl::align_up(size, huge_page_size);
+        alignment = std::max(alignment, huge_page_size);
+    #if defined(MAP_HUGETLB)
+        if (auto ptr = impl::map_aligned(size, alignment, MAP_HUGETLB))
+        {
+            return ptr;
+        }
+    #endif
+        auto ptr = impl::map_aligned(size, alignment, 0);
+        if (!ptr)
+        {
+            throw std::bad_alloc();
+        }
+    #if defined(MADV_HUGEPAGE)
+        madvise(ptr, size, MADV_HUGEPAGE);
+    #endif
+        return ptr;
+#elif defined(_WIN32)
+        auto large_page_size = GetLargePageMinimum();
+        if (large_page_size && alignment <= large_page_size)
+        {
+            if (auto ptr = impl::map_aligned(impl::align_up(size, large_page_size), large_page_size, MEM_LARGE_PAGES))
+            {
+                return ptr;
+            }
+        }
+        return page_block_provider_t().allocate(size, alignment);
+#else
+        return ::operator new(size, std::align_val_t(alignment));
+#endif
+    }
+
+    inline auto huge_page_block_provider_t::deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        munmap(ptr, impl::align_up(size, huge_page_size));
+#elif defined(_WIN32)
+        VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+        ::operator delete(ptr, std::align_val_t(alignment));
+#endif
+    }
+
+    inline auto huge_page_block_provider_t::decommit(void_t* ptr, size_t size) -> bool_t
+    {
+        // Large pages on Windows cannot be decommitted.
+#if defined(_WIN32)
+        return false;
+#else
+        return impl::decommit(ptr, size);
+#endif
+    }
+
+    inline auto huge_page_block_provider_t::commit(void_t* ptr, size_t size) -> void_t
+    {
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    inline mapped_file_t::mapped_file_t(const char* path, void_t* base, size_t capacity)
+    {
+        fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+
+        // Only one process may have the file mapped.
+        struct stat file_stat;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &file_stat) != 0)
+        {
+            auto error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+
+        existed = file_stat.st_size != 0;
+        if (existed)
+        {
+            capacity = size_t(file_stat.st_size);
+        }
+        else if (ftruncate(fd, off_t(capacity)) != 0)
+        {
+            auto error = errno;
+            [[maybe_unused]] auto emptied = ftruncate(fd, 0);
+            close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+
+        auto flags = MAP_SHARED;
+    #if defined(MAP_FIXED_NOREPLACE)
+        flags |= MAP_FIXED_NOREPLACE;
+    #endif
+        auto ptr = mmap(base, capacity, PROT_READ | PROT_WRITE, flags, fd, 0);
+        if (ptr != base)
+        {
+            auto error = ptr == MAP_FAILED ? errno : EEXIST;
+            if (ptr != MAP_FAILED)
+            {
+                munmap(ptr, capacity);
+            }
+            if (!existed)
+            {
+                [[maybe_unused]] auto emptied = ftruncate(fd, 0);
+            }
+            close(fd);
+            throw std::system_error(error, std::generic_category(), std::string("mpa: cannot map ") + path + " at its base address");
+        }
+
+        // The magic number is written last, so a file whose first run died before setting it up is still zero
+        // there and is set up again.
+        header = (header_t*)ptr;
+        if (existed && !header->magic)
+        {
+            existed = false;
+        }
+        if (!existed)
+        {
+            header->base = base;
+            header->capacity = capacity;
+            header->end = impl::align_up(sizeof(header_t) + capacity / impl::page_size() * sizeof(size_t), impl::page_size());
+            header->free_blocks = nullptr;
+            header->magic = magic;
+        }
+        else if (header->magic != magic || header->base != base || header->capacity != capacity)
+        {
+            munmap(ptr, capacity);
+            close(fd);
+            throw std::runtime_error("mpa: not a mapped file for this base address");
+        }
+    }
+
+    inline mapped_file_t::~mapped_file_t()
+    {
+        munmap(header, header->capacity);
+        close(fd);
+    }
+
+    inline auto mapped_file_t::restored() const -> bool_t
+    {
+        return existed;
+    }
+
+    inline auto mapped_file_t::root() const -> void_t*
+    {
+        return header->root;
+    }
+
+    inline auto mapped_file_t::sync() -> void_t
+    {
+        msync(header, header->capacity, MS_SYNC);
+    }
+
+    inline auto mapped_file_t::directory() const -> size_t*
+    {
+        return (size_t*)(header + 1);
+    }
+
+    inline auto mapped_file_t::allocate(size_t size, size_t alignment) -> void_t*
+    {
+        lock_guard_t<mutex_t> lg(mutex);
+        auto base = uintptr_t(header);
+        void_t* ptr = nullptr;
+
+        // Blocks of a multi_pool_t all have the same size, so only exact matches are reused.
+        for (auto link = &header->free_blocks; *link; link = &((free_block_t*)*link)->next)
+        {
+            auto free_block = (free_block_t*)*link;
+            if (free_block->size == size && uintptr_t(free_block) % alignment == 0)
+            {
+                *link = free_block->next;
+                ptr = free_block;
+                break;
+            }
+        }
+
+        if (!ptr)
+        {
+            auto begin = impl::align_up(base + header->end, std::max(alignment, impl::page_size()));
+            if (begin + size > base + header->capacity)
+            {
+                throw std::bad_alloc();
+            }
+            header->end = begin + size - base;
+            ptr = (void_t*)begin;
+        }
+
+        directory()[(uintptr_t(ptr) - base) / impl::page_size()] = size;
+        return ptr;
+    }
+
+    inline auto mapped_file_t::deallocate(void_t* ptr, size_t size) -> void_t
+    {
+        lock_guard_t<mutex_t> lg(mutex);
+        directory()[(uintptr_t(ptr) - uintptr_t(header)) / impl::page_size()] = 0;
+
+        auto free_block = (free_block_t*)ptr;
+        free_block->next = header->free_blocks;
+        free_block->size = size;
+        header->free_blocks = free_block;
+    }
+
+    template <typename Function>
+    auto mapped_file_t::for_each_block(Function function) -> void_t
+    {
+        auto page_size = impl::page_size();
+        auto pages = impl::align_up(header->end, page_size) / page_size;
+        for (auto page = size_t(0); page < pages; ++page)
+        {
+            if (auto size = directory()[page])
+            {
+                function((u8_t*)header + page * page_size, size);
+                page += (size - 1) / page_size;
+            }
+        }
+    }
+
+    inline mapped_file_block_provider_t::mapped_file_block_provider_t(mapped_file_t& file) noexcept :
+        file(&file)
+    {
+    }
+
+    inline auto mapped_file_block_provider_t::allocate(size_t size, size_t alignment) -> void_t*
+    {
+        return file->allocate(size, alignment);
+    }
+
+    inline auto mapped_file_block_provider_t::deallocate(void_t* ptr, size_t size, size_t alignment) -> void_t
+    {
+        file->deallocate(ptr, size);
+    }
+
+    inline auto mapped_file_block_provider_t::decommit(void_t* ptr, size_t size) -> bool_t
+    {
+        return impl::decommit(ptr, size);
+    }
+
+    inline auto mapped_file_block_provider_t::commit(void_t* ptr, size_t size) -> void_t
+    {
+    }
+
+    template <typename Function>
+    auto mapped_file_block_provider_t::for_each_block(Function function) -> void_t
+    {
+        file->for_each_block(function);
+    }
+#endif
+
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    multi_pool_t<T, BlockProvider, Geometry, Placement>::multi_pool_t()
+    {
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    multi_pool_t<T, BlockProvider, Geometry, Placement>::multi_pool_t(const BlockProvider& provider) :
+        block_provider(provider)
+    {
+        if constexpr (persistent)
+        {
+            adopt_blocks();
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    multi_pool_t<T, BlockProvider, Geometry, Placement>::~multi_pool_t()
+    {
+        for (auto memory_block : memory_blocks)
+        {
+            impl::unpoison(memory_block.ptr, block_size);
+            block_provider.deallocate(memory_block.ptr, block_size, block_alignment);
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::pools_of(const block_type& memory_block) -> pool_type*
+    {
+        return (pool_type*)((u8_t*)memory_block.ptr + pools_offset);
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::use_pool(block_type& memory_block, u32_t pool_idx) -> pool_type*
+    {
+        auto pool = pools_of(memory_block) + pool_idx;
+
+        // Pools past the mark are all unmaxed, so the lowest unmaxed pool is at most the mark.
+        if (pool_idx == memory_block.initialized_pools)
+        {
+            pool->init();
+            ++memory_block.initialized_pools;
+            persist_initialized_pools(memory_block);
+        }
+        return pool;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::persist_initialized_pools(const block_type& memory_block) -> void_t
+    {
+        if constexpr (persistent)
+        {
+            ((impl::block_header_t*)memory_block.ptr)->initialized_pools = memory_block.initialized_pools;
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::adopt_blocks() -> void_t
+    {
+        block_provider.for_each_block([&](void_t* ptr, size_t size)
+        {
+            auto header = (impl::block_header_t*)ptr;
+            if (size != block_size || header->owner != this)
+            {
+                return;
+            }
+
+            header->index = memory_blocks.size();
+            block_type memory_block = { ptr, all_pools, 0, header->initialized_pools, current_node(), 0, false, 1 };
+            for (auto pool_idx = 0u; pool_idx < memory_block.initialized_pools; ++pool_idx)
+            {
+                auto& pool = pools_of(memory_block)[pool_idx];
+                auto free_slots = size_t(0);
+                for (auto word : pool.unallocated_slots)
+                {
+                    free_slots += std::popcount(word);
+                }
+
+                memory_block.live_slots += u32_t(pool_type::pool_size - free_slots);
+                if (pool.full())
+                {
+                    memory_block.unmaxed_pools &= ~(u64_t(1) << pool_idx);
+                }
+            }
+            memory_block.bucket = occupancy_bucket(memory_block.live_slots);
+            memory_blocks.push_back(memory_block);
+
+            auto tree_count = (memory_block.node + 1) * occupancy_buckets;
+            if (unmaxed_blocks.size() < tree_count)
+            {
+                unmaxed_blocks.resize(tree_count);
+            }
+            for (auto& node_blocks : unmaxed_blocks)
+            {
+                node_blocks.resize(memory_blocks.size());
+            }
+            if (run_blocks.size() < (memory_block.node + 1) * run_lengths)
+            {
+                run_blocks.resize((memory_block.node + 1) * run_lengths);
+            }
+            for (auto& node_runs : run_blocks)
+            {
+                node_runs.resize(memory_blocks.size());
+            }
+            raise_run_bound(memory_blocks.size() - 1);
+            if (memory_block.unmaxed_pools)
+            {
+                unmaxed_blocks_of(memory_blocks.size() - 1).set(memory_blocks.size() - 1);
+            }
+            if (!memory_block.live_slots)
+            {
+                ++empty_blocks;
+            }
+            // Objects left by the previous run count as allocated by this one.
+            counters.allocations += memory_block.live_slots;
+
+            // Remote frees queued before the previous run ended are collected as usual.
+            header->next_remote = nullptr;
+            if (header->remote_frees.load(std::memory_order_relaxed))
+            {
+                header->next_remote = remote_blocks.load(std::memory_order_relaxed);
+                remote_blocks.store(header, std::memory_order_relaxed);
+            }
+        });
+
+        counters.peak_live_slots = counters.allocations;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::current_node() -> u32_t
+    {
+        if constexpr (numa_aware)
+        {
+            return u32_t(block_provider.current_node());
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::unmaxed_blocks_of(size_t block_idx) -> impl::bit_tree_t<u64_t>&
+    {
+        auto& memory_block = memory_blocks[block_idx];
+        return unmaxed_blocks[memory_block.node * occupancy_buckets + memory_block.bucket];
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::occupancy_bucket(u32_t live_slots) -> u32_t
+    {
+        if (!live_slots)
+        {
+            return 0;
+        }
+        return std::min(occupancy_buckets - 1, u32_t(1 + u64_t(live_slots) * (occupancy_buckets - 1) / slots_in_block));
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::update_bucket(size_t block_idx) -> void_t
+    {
+        if constexpr (occupancy_buckets > 1)
+        {
+            auto& memory_block = memory_blocks[block_idx];
+            auto bucket = occupancy_bucket(memory_block.live_slots);
+            if (bucket == memory_block.bucket)
+            {
+                return;
+            }
+
+            if (memory_block.unmaxed_pools)
+            {
+                unmaxed_blocks_of(block_idx).clear(block_idx);
+                memory_block.bucket = bucket;
+                unmaxed_blocks_of(block_idx).set(block_idx);
+            }
+            else
+            {
+                memory_block.bucket = bucket;
+            }
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::new_block(u32_t node) -> void_t
+    {
+        auto ptr = block_provider.allocate(block_size, block_alignment);
+        auto header = new (ptr) impl::block_header_t;
+        header->index = memory_blocks.size();
+        header->owner = this;
+        header->remote_frees.store(nullptr, std::memory_order_relaxed);
+        header->next_remote = nullptr;
+        header->initialized_pools = 0;
+
+        if constexpr (stats_enabled)
+        {
+            ++counters.blocks_created;
+        }
+
+        block_type memory_block = { ptr, all_pools, 0, 0, node, 0, false, 1 };
+        memory_blocks.push_back(memory_block);
+
+        if (unmaxed_blocks.size() < (node + 1) * occupancy_buckets)
+        {
+            unmaxed_blocks.resize((node + 1) * occupancy_buckets);
+        }
+        for (auto& node_blocks : unmaxed_blocks)
+        {
+            node_blocks.resize(memory_blocks.size());
+        }
+        unmaxed_blocks_of(memory_blocks.size() - 1).set(memory_blocks.size() - 1);
+
+        if (run_blocks.size() < (node + 1) * run_lengths)
+        {
+            run_blocks.resize((node + 1) * run_lengths);
+        }
+        for (auto& node_runs : run_blocks)
+        {
+            node_runs.resize(memory_blocks.size());
+        }
+        raise_run_bound(memory_blocks.size() - 1);
+        ++empty_blocks;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::count_allocations(size_t n) -> void_t
+    {
+        if constexpr (stats_enabled)
+        {
+            counters.allocations += n;
+            counters.peak_live_slots = std::max(counters.peak_live_slots, counters.allocations - counters.deallocations);
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::count_deallocations(size_t n) -> void_t
+    {
+        if constexpr (stats_enabled)
+        {
+            counters.deallocations += n;
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::release_block(size_t block_idx) -> void_t
+    {
+        auto& memory_block = memory_blocks[block_idx];
+        assert(!memory_block.live_slots);
+        recently_freed = nullptr;
+        cursor_block = impl::bit_tree_t<u64_t>::npos;
+
+        if constexpr (stats_enabled)
+        {
+            ++counters.blocks_released;
+        }
+
+        if (!memory_block.decommitted)
+        {
+            --empty_blocks;
+        }
+        impl::unpoison(memory_block.ptr, block_size);
+        block_provider.deallocate(memory_block.ptr, block_size, block_alignment);
+
+        unmaxed_blocks_of(block_idx).clear(block_idx);
+        lower_run_bound(block_idx, 2);
+
+        // Move the last block into the freed entry.
+        auto last_idx = memory_blocks.size() - 1;
+        if (block_idx != last_idx)
+        {
+            memory_block = memory_blocks[last_idx];
+            ((impl::block_header_t*)memory_block.ptr)->index = block_idx;
+
+            auto& node_blocks = unmaxed_blocks_of(block_idx);
+            if (node_blocks.test(last_idx))
+            {
+                node_blocks.set(block_idx);
+                node_blocks.clear(last_idx);
+            }
+            for (auto n = size_t(2); n <= memory_block.run_bound; ++n)
+            {
+                run_blocks_of(memory_block.node, n).set(block_idx);
+                run_blocks_of(memory_block.node, n).clear(last_idx);
+            }
+        }
+
+        memory_blocks.pop_back();
+        for (auto& node_blocks : unmaxed_blocks)
+        {
+            node_blocks.resize(memory_blocks.size());
+        }
+        for (auto& node_runs : run_blocks)
+        {
+            node_runs.resize(memory_blocks.size());
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::set_retained_empty_blocks(size_t count) -> void_t
+    {
+        retained_empty_blocks = count;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::trim(size_t retain, trim_t mode) -> size_t
+    {
+        auto trimmed = size_t(0);
+        recently_freed = nullptr;
+        flush();
+
+        // Walking backwards keeps the blocks moved by release_block behind the cursor.
+        for (auto i = memory_blocks.size() - 1; i < memory_blocks.size() && empty_blocks > retain; --i)
+        {
+            auto& memory_block = memory_blocks[i];
+            if (memory_block.live_slots || memory_block.decommitted)
+            {
+                continue;
+            }
+
+            auto header_size = sizeof(impl::block_header_t);
+            if (mode == trim_t::decommit && block_provider.decommit((u8_t*)memory_block.ptr + header_size, block_size - header_size))
+            {
+                memory_block.decommitted = true;
+                memory_block.initialized_pools = 0;
+                persist_initialized_pools(memory_block);
+                --empty_blocks;
+                cursor_block = impl::bit_tree_t<u64_t>::npos;
+            }
+            else
+            {
+                release_block(i);
+            }
+            ++trimmed;
+        }
+
+        return trimmed;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::reset() -> void_t
+    {
+        empty_blocks = 0;
+
+        for (auto i = size_t(0); i < memory_blocks.size(); ++i)
+        {
+            auto& memory_block = memory_blocks[i];
+            auto header = (impl::block_header_t*)memory_block.ptr;
+            header->remote_frees.store(nullptr, std::memory_order_relaxed);
+            header->next_remote = nullptr;
+
+            // Pools are initialized again on first use, so no bitmap is touched here.
+            for (auto pool_idx = 0u; pool_idx < memory_block.initialized_pools; ++pool_idx)
+            {
+                impl::poison(pools_of(memory_block)[pool_idx].data, sizeof(pool_type::data));
+            }
+            memory_block.unmaxed_pools = all_pools;
+            memory_block.live_slots = 0;
+            memory_block.initialized_pools = 0;
+            persist_initialized_pools(memory_block);
+            unmaxed_blocks_of(i).clear(i);
+            memory_block.bucket = 0;
+            unmaxed_blocks_of(i).set(i);
+            raise_run_bound(i);
+
+            if (!memory_block.decommitted)
+            {
+                ++empty_blocks;
+            }
+        }
+
+        remote_blocks.store(nullptr, std::memory_order_relaxed);
+        recently_freed = nullptr;
+        cursor_block = impl::bit_tree_t<u64_t>::npos;
+        free_list = nullptr;
+        free_list_length = 0;
+        // The slots freed by reset count as deallocations.
+        counters.deallocations = counters.allocations;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::sparse_blocks(double max_occupancy) const -> vector_t<block_info_t>
+    {
+        vector_t<block_info_t> blocks;
+
+        for (auto& memory_block : memory_blocks)
+        {
+            auto occupancy = double(memory_block.live_slots) / double(slots_in_block);
+            if (memory_block.live_slots && occupancy <= max_occupancy)
+            {
+                blocks.push_back({ memory_block.ptr, (u8_t*)memory_block.ptr + block_size, memory_block.live_slots, occupancy });
+            }
+        }
+
+        return blocks;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::occupancy_of(const T* ptr) const -> double
+    {
+        auto header = impl::block_header_of<block_alignment>(ptr);
+        return double(memory_blocks[header->index].live_slots) / double(slots_in_block);
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::stats() const -> pool_stats_t
+    {
+        pool_stats_t stats;
+        stats.counters = counters;
+        stats.counters.live_slots = counters.allocations - counters.deallocations;
+        stats.blocks = memory_blocks.size();
+        stats.empty_blocks = empty_blocks;
+        stats.block_capacity = slots_in_block;
+
+        for (auto& memory_block : memory_blocks)
+        {
+            stats.decommitted_blocks += memory_block.decommitted;
+            stats.block_occupancy.push_back(double(memory_block.live_slots) / double(stats.block_capacity));
+        }
+
+        return stats;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::unmaxed_block() -> size_t
+    {
+        // A thread never takes blocks of another node, it gets a new block on its own node instead.
+        auto node = current_node();
+        auto block_idx = impl::bit_tree_t<u64_t>::npos;
+
+        for (auto bucket = occupancy_buckets - 1; bucket < occupancy_buckets && block_idx == impl::bit_tree_t<u64_t>::npos; --bucket)
+        {
+            auto tree_idx = node * occupancy_buckets + bucket;
+            if (tree_idx < unmaxed_blocks.size())
+            {
+                block_idx = unmaxed_blocks[tree_idx].find_first();
+            }
+        }
+
+        if (block_idx == impl::bit_tree_t<u64_t>::npos)
+        {
+            new_block(node);
+            return memory_blocks.size() - 1;
+        }
+
+        commit_block(block_idx);
+        return block_idx;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::commit_block(size_t block_idx) -> void_t
+    {
+        auto& memory_block = memory_blocks[block_idx];
+        if (memory_block.decommitted)
+        {
+            auto header_size = sizeof(impl::block_header_t);
+            block_provider.commit((u8_t*)memory_block.ptr + header_size, block_size - header_size);
+            memory_block.decommitted = false;
+            ++empty_blocks;
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::allocate(size_t n) -> T*
+    {
+        if (n > 1)
+        {
+            return allocate_run(n);
+        }
+
+        if constexpr (Placement == placement_t::recently_freed)
+        {
+            if (recently_freed)
+            {
+                auto hint = recently_freed;
+                recently_freed = nullptr;
+                return allocate_near(hint);
+            }
+        }
+
+        if constexpr (uses_free_list)
+        {
+            if (free_list)
+            {
+                auto result = free_list;
+                impl::unpoison(result, sizeof(T));
+                memcpy(&free_list, (void_t*)result, sizeof(free_list));
+                --free_list_length;
+                count_allocations(1);
+                return result;
+            }
+        }
+
+        return allocate_lowest();
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::allocate_lowest() -> T*
+    {
+        if constexpr (occupancy_buckets > 1)
+        {
+            auto block_idx = unmaxed_block();
+            return allocate_from(block_idx, impl::ctz(memory_blocks[block_idx].unmaxed_pools), nullptr);
+        }
+        else
+        {
+            if (cursor_block == impl::bit_tree_t<u64_t>::npos || (numa_aware && cursor_node != current_node()) ||
+                !impl::test_bit(memory_blocks[cursor_block].unmaxed_pools, cursor_pool))
+            {
+                cursor_block = unmaxed_block();
+                cursor_pool = impl::ctz(memory_blocks[cursor_block].unmaxed_pools);
+                cursor_node = memory_blocks[cursor_block].node;
+            }
+
+            auto& memory_block = memory_blocks[cursor_block];
+            auto result = allocate_from(cursor_block, cursor_pool, nullptr);
+
+            // The next free slot is almost always on the line of result or the one after it, but the bitmaps of
+            // the pool taken next are usually cold. They are fetched once the last word of this pool is in use.
+            auto pool = pools_of(memory_block) + cursor_pool;
+            if (pool->full())
+            {
+                // A full block leaves the cursor on a cleared bit, the next call searches again.
+                if (memory_block.unmaxed_pools)
+                {
+                    cursor_pool = impl::ctz(memory_block.unmaxed_pools);
+                }
+            }
+            else if (std::has_single_bit(pool->unused_words))
+            {
+                if (auto later_pools = memory_block.unmaxed_pools >> cursor_pool >> 1)
+                {
+                    impl::prefetch(pool + 1 + impl::ctz(later_pools));
+                }
+            }
+            return result;
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::lower_cursor(size_t block_idx) -> void_t
+    {
+        // Blocks below the cursor were full, so the lowest free pool of block_idx is the new lowest one.
+        if (cursor_block != impl::bit_tree_t<u64_t>::npos && block_idx <= cursor_block &&
+            memory_blocks[block_idx].node == cursor_node)
+        {
+            cursor_block = block_idx;
+            cursor_pool = impl::ctz(memory_blocks[block_idx].unmaxed_pools);
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::allocate_near(const void_t* hint) -> T*
+    {
+        if (!hint)
+        {
+            return allocate_lowest();
+        }
+
+        auto header = impl::block_header_of<block_alignment>(hint);
+        if (header->owner != this)
+        {
+            return allocate_lowest();
+        }
+
+        auto block_idx = header->index;
+        auto& memory_block = memory_blocks[block_idx];
+        auto pool_idx = u32_t(((const u8_t*)hint - (u8_t*)pools_of(memory_block)) / sizeof(pool_type));
+        assert(pool_idx < memory_block.initialized_pools);
+
+        if (impl::test_bit(memory_block.unmaxed_pools, pool_idx))
+        {
+            return allocate_from(block_idx, pool_idx, (const T*)hint);
+        }
+        if (memory_block.unmaxed_pools)
+        {
+            return allocate_from(block_idx, impl::ctz(memory_block.unmaxed_pools), nullptr);
+        }
+        return allocate_lowest();
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::allocate_from(size_t block_idx, u32_t pool_idx, const T* hint) -> T*
+    {
+        auto& memory_block = memory_blocks[block_idx];
+
+        if (!memory_block.live_slots++)
+        {
+            --empty_blocks;
+        }
+        count_allocations(1);
+
+        auto pool = use_pool(memory_block, pool_idx);
+        auto result = hint ? pool->allocate_near(hint) : pool->allocate();
+        if (pool->full())
+        {
+            impl::clear_bit(memory_block.unmaxed_pools, pool_idx);
+            if (!memory_block.unmaxed_pools)
+            {
+                unmaxed_blocks_of(block_idx).clear(block_idx);
+            }
+        }
+        update_bucket(block_idx);
+        return result;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::allocate_run(size_t n) -> T*
+    {
+        if (n > max_contiguous)
+        {
+            return (T*)::operator new(n * sizeof(T), std::align_val_t(alignof(T)));
+        }
+
+        // Only blocks that may have a run of n are searched, starting from the pool the last run came from,
+        // which usually still has room for the next, and wrapping around. A block without one is taken off the
+        // tree of n until slots of it are freed, so every failed search was paid for by an earlier free. A
+        // fresh block always has a run.
+        auto node = current_node();
+        if (node < run_blocks.size() / run_lengths && !memory_blocks.empty())
+        {
+            // run_block is past the end once blocks were released.
+            auto first_block = run_block % memory_blocks.size();
+            auto& candidates = run_blocks_of(node, n);
+            auto block_idx = candidates.find_next(first_block);
+            auto wrapped = false;
+            while (true)
+            {
+                if (block_idx == impl::bit_tree_t<u64_t>::npos)
+                {
+                    if (wrapped || !first_block)
+                    {
+                        break;
+                    }
+                    wrapped = true;
+                    block_idx = candidates.find_first();
+                    continue;
+                }
+                if (wrapped && block_idx >= first_block)
+                {
+                    break;
+                }
+
+                if (auto result = allocate_run_from(block_idx, n, block_idx == first_block ? run_pool : 0))
+                {
+                    return result;
+                }
+                lower_run_bound(block_idx, n);
+                block_idx = candidates.find_next(block_idx + 1);
+            }
+        }
+
+        new_block(node);
+        return allocate_run_from(memory_blocks.size() - 1, n, 0);
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::run_blocks_of(u32_t node, size_t n) -> impl::bit_tree_t<u64_t>&
+    {
+        return run_blocks[node * run_lengths + n - 2];
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::raise_run_bound(size_t block_idx) -> void_t
+    {
+        auto& memory_block = memory_blocks[block_idx];
+        for (auto n = size_t(memory_block.run_bound) + 1; n <= max_contiguous; ++n)
+        {
+            run_blocks_of(memory_block.node, n).set(block_idx);
+        }
+        memory_block.run_bound = u32_t(max_contiguous);
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::lower_run_bound(size_t block_idx, size_t n) -> void_t
+    {
+        auto& memory_block = memory_blocks[block_idx];
+        for (auto m = n; m <= memory_block.run_bound; ++m)
+        {
+            run_blocks_of(memory_block.node, m).clear(block_idx);
+        }
+        memory_block.run_bound = std::min(memory_block.run_bound, u32_t(n - 1));
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::allocate_run_from(size_t block_idx, size_t n, u32_t first_pool) -> T*
+    {
+        // A decommitted block is empty, so the run is found in its first pool.
+        commit_block(block_idx);
+        auto& memory_block = memory_blocks[block_idx];
+
+        // Pools past the mark may only be reached through the mark, which initializes them in order.
+        auto later_pools = ~u64_t(0) << std::min(first_pool, memory_block.initialized_pools);
+
+        for (auto pass = 0; pass < 2; ++pass)
+        {
+            auto pools = memory_block.unmaxed_pools & (pass ? ~later_pools : later_pools);
+            for (; pools; pools &= pools - 1)
+            {
+                auto pool_idx = impl::ctz(pools);
+                auto pool = use_pool(memory_block, pool_idx);
+                auto result = pool->allocate_contiguous(u32_t(n));
+                if (!result)
+                {
+                    continue;
+                }
+
+                if (!memory_block.live_slots)
+                {
+                    --empty_blocks;
+                }
+                memory_block.live_slots += u32_t(n);
+                count_allocations(n);
+                run_block = block_idx;
+                run_pool = pool_idx;
+
+                if (pool->full())
+                {
+                    impl::clear_bit(memory_block.unmaxed_pools, pool_idx);
+                    if (!memory_block.unmaxed_pools)
+                    {
+                        unmaxed_blocks_of(block_idx).clear(block_idx);
+                    }
+                }
+                update_bucket(block_idx);
+                return result;
+            }
+        }
+
+        return nullptr;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::deallocate(T* ptr, size_t n) -> void_t
+    {
+        if (n > max_contiguous)
+        {
+            ::operator delete(ptr, n * sizeof(T), std::align_val_t(alignof(T)));
+            return;
+        }
+
+        n = std::max(n, size_t(1));
+        count_deallocations(n);
+
+        if constexpr (hardened)
+        {
+            check_allocated(ptr, n);
+        }
+
+        if constexpr (uses_free_list)
+        {
+            if (n == 1)
+            {
+                if (free_list_length == free_list_capacity)
+                {
+                    flush();
+                }
+                impl::fill_freed(ptr, sizeof(T));
+                memcpy((void_t*)ptr, &free_list, sizeof(free_list));
+                impl::poison(ptr, sizeof(T));
+                free_list = ptr;
+                ++free_list_length;
+                return;
+            }
+        }
+
+        free_slots(ptr, n);
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::free_slots(T* ptr, size_t n) -> void_t
+    {
+        auto header = impl::block_header_of<block_alignment>(ptr);
+        assert(header->index < memory_blocks.size() && memory_blocks[header->index].ptr == header);
+
+        auto& memory_block = memory_blocks[header->index];
+        auto pool_idx = u32_t(((u8_t*)ptr - (u8_t*)pools_of(memory_block)) / sizeof(pool_type));
+        assert(pool_idx < pools_in_block);
+
+        auto pool = pools_of(memory_block) + pool_idx;
+        if (!memory_block.unmaxed_pools)
+        {
+            unmaxed_blocks_of(header->index).set(header->index);
+        }
+        impl::set_bit(memory_block.unmaxed_pools, pool_idx);
+        lower_cursor(header->index);
+        if (memory_block.run_bound < max_contiguous)
+        {
+            raise_run_bound(header->index);
+        }
+        if (n > 1)
+        {
+            pool->deallocate_contiguous(ptr, u32_t(n));
+        }
+        else
+        {
+            pool->deallocate(ptr);
+        }
+
+        if constexpr (Placement == placement_t::recently_freed)
+        {
+            recently_freed = ptr;
+        }
+
+        memory_block.live_slots -= u32_t(n);
+        update_bucket(header->index);
+
+        if (!memory_block.live_slots && ++empty_blocks > retained_empty_blocks)
+        {
+            release_block(header->index);
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::check_allocated(const T* ptr, size_t n) -> void_t
+    {
+        auto header = impl::block_header_of<block_alignment>(ptr);
+        if (header->owner != this || header->index >= memory_blocks.size() || memory_blocks[header->index].ptr != header)
+        {
+            impl::report_misuse("deallocated pointer does not belong to this pool");
+        }
+
+        auto& memory_block = memory_blocks[header->index];
+        auto offset = size_t((const u8_t*)ptr - (const u8_t*)pools_of(memory_block));
+        auto pool_idx = u32_t(std::min(offset / sizeof(pool_type), size_t(pools_in_block)));
+        if ((const u8_t*)ptr < (const u8_t*)pools_of(memory_block) || pool_idx >= memory_block.initialized_pools)
+        {
+            impl::report_misuse("deallocated pointer does not belong to this pool");
+        }
+
+        // The bitmaps precede data in every pool, ptr must be a multiple of sizeof(T) into data.
+        auto pool = pools_of(memory_block) + pool_idx;
+        auto data_offset = size_t((const u8_t*)ptr - (const u8_t*)pool->data);
+        auto index = data_offset / sizeof(T);
+        if (ptr < pool->data || data_offset % sizeof(T) || index >= pool_type::pool_size)
+        {
+            impl::report_misuse("deallocated pointer does not start a slot");
+        }
+        if (index / pool_type::word_bits != (index + n - 1) / pool_type::word_bits)
+        {
+            impl::report_misuse("deallocated run does not fit in a pool word");
+        }
+
+        for (auto i = index; i < index + n; ++i)
+        {
+            if (impl::test_bit(pool->unallocated_slots[i / pool_type::word_bits], i % pool_type::word_bits))
+            {
+                impl::report_misuse("double free");
+            }
+        }
+
+        if constexpr (uses_free_list)
+        {
+            for (auto slot = free_list; slot;)
+            {
+                if (slot >= ptr && slot < ptr + n)
+                {
+                    impl::report_misuse("double free");
+                }
+                impl::unpoison(slot, sizeof(T));
+                auto next = slot;
+                memcpy(&next, (void_t*)slot, sizeof(next));
+                impl::poison(slot, sizeof(T));
+                slot = next;
+            }
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::flush() -> void_t
+    {
+        // The link is read before the slot is freed, its block may be released by free_slots.
+        while (free_list)
+        {
+            auto ptr = free_list;
+            impl::unpoison(ptr, sizeof(T));
+            memcpy(&free_list, (void_t*)ptr, sizeof(free_list));
+            free_slots(ptr, 1);
+        }
+        free_list_length = 0;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::allocate_bulk(T** out, size_t count) -> void_t
+    {
+        while (count)
+        {
+            auto block_idx = unmaxed_block();
+            auto& memory_block = memory_blocks[block_idx];
+
+            if (!memory_block.live_slots)
+            {
+                --empty_blocks;
+            }
+
+            while (count && memory_block.unmaxed_pools)
+            {
+                auto pool_idx = impl::ctz(memory_block.unmaxed_pools);
+                auto pool = use_pool(memory_block, pool_idx);
+                auto allocated = pool->allocate_bulk(out, count);
+
+                out += allocated;
+                count -= allocated;
+                memory_block.live_slots += u32_t(allocated);
+                count_allocations(allocated);
+
+                if (pool->full())
+                {
+                    impl::clear_bit(memory_block.unmaxed_pools, pool_idx);
+                }
+            }
+
+            if (!memory_block.unmaxed_pools)
+            {
+                unmaxed_blocks_of(block_idx).clear(block_idx);
+            }
+            update_bucket(block_idx);
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::deallocate_bulk(T* const* ptrs, size_t count) -> void_t
+    {
+        if constexpr (hardened)
+        {
+            for (auto i = size_t(0); i < count; ++i)
+            {
+                check_allocated(ptrs[i], 1);
+            }
+        }
+
+        // Sorting groups the slots by block, pool and word, so every bitmap is written once per group. Larger
+        // batches are sorted and freed a chunk at a time, a group split between chunks is just written twice.
+        T* sorted[bulk_chunk];
+        for (auto first = size_t(0); first < count; first += bulk_chunk)
+        {
+            auto chunk_count = std::min(count - first, bulk_chunk);
+            std::copy(ptrs + first, ptrs + first + chunk_count, sorted);
+            std::sort(sorted, sorted + chunk_count);
+            deallocate_sorted(sorted, chunk_count);
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::deallocate_sorted(T* const* sorted, size_t count) -> void_t
+    {
+        for (auto i = size_t(0); i < count;)
+        {
+            auto header = impl::block_header_of<block_alignment>(sorted[i]);
+            assert(header->index < memory_blocks.size() && memory_blocks[header->index].ptr == header);
+
+            auto& memory_block = memory_blocks[header->index];
+            if (!memory_block.unmaxed_pools)
+            {
+                unmaxed_blocks_of(header->index).set(header->index);
+            }
+
+            while (i < count && impl::block_header_of<block_alignment>(sorted[i]) == header)
+            {
+                auto pool_idx = u32_t(((u8_t*)sorted[i] - (u8_t*)pools_of(memory_block)) / sizeof(pool_type));
+                assert(pool_idx < pools_in_block);
+
+                auto pool = pools_of(memory_block) + pool_idx;
+                auto pool_end = (T*)(pool + 1);
+                auto run = i;
+
+                while (i < count && sorted[i] < pool_end)
+                {
+                    ++i;
+                }
+
+                impl::set_bit(memory_block.unmaxed_pools, pool_idx);
+                pool->deallocate_bulk(&sorted[run], i - run);
+                memory_block.live_slots -= u32_t(i - run);
+                count_deallocations(i - run);
+            }
+            lower_cursor(header->index);
+            if (memory_block.run_bound < max_contiguous)
+            {
+                raise_run_bound(header->index);
+            }
+            update_bucket(header->index);
+
+            if (!memory_block.live_slots && ++empty_blocks > retained_empty_blocks)
+            {
+                release_block(header->index);
+            }
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::owner_of(const T* ptr) -> multi_pool_t*
+    {
+        return (multi_pool_t*)impl::block_header_of<block_alignment>(ptr)->owner;
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::deallocate_remote(T* ptr, size_t n) -> void_t
+        requires (sizeof(T) >= sizeof(void_t*))
+    {
+        if (n > max_contiguous)
+        {
+            ::operator delete(ptr, n * sizeof(T), std::align_val_t(alignof(T)));
+            return;
+        }
+
+        // The slots of a run are queued one by one and the owner frees them as single slots.
+        auto header = impl::block_header_of<block_alignment>(ptr);
+        auto first = ptr;
+        for (auto i = size_t(1); i < std::max(n, size_t(1)); ++i)
+        {
+            auto slot = ptr + i;
+            memcpy((void_t*)slot, &first, sizeof(first));
+            first = slot;
+        }
+
+        auto next = header->remote_frees.load(std::memory_order_relaxed);
+        do
+        {
+            memcpy((void_t*)ptr, &next, sizeof(next));
+        } while (!header->remote_frees.compare_exchange_weak(next, first, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+        // Only the free that makes the list non-empty queues the block, so a block is queued at most once
+        // until the owner drains it.
+        if (!next)
+        {
+            auto owner = (multi_pool_t*)header->owner;
+            auto next_block = owner->remote_blocks.load(std::memory_order_relaxed);
+            do
+            {
+                header->next_remote = next_block;
+            } while (!owner->remote_blocks.compare_exchange_weak(next_block, header, std::memory_order_release, std::memory_order_relaxed));
+        }
+    }
+
+    template <typename T, typename BlockProvider, typename Geometry, placement_t Placement>
+    auto multi_pool_t<T, BlockProvider, Geometry, Placement>::collect_remote() -> void_t
+    {
+        if (!remote_blocks.load(std::memory_order_relaxed))
+        {
+            return;
+        }
+
+        auto header = remote_blocks.exchange(nullptr, std::memory_order_acquire);
+        while (header)
+        {
+            // Read the link first, the block may be queued again as soon as its list is taken.
+            auto next_header = header->next_remote;
+            auto ptr = header->remote_frees.exchange(nullptr, std::memory_order_acq_rel);
+
+            while (ptr)
+            {
+                void_t* next;
+                memcpy(&next, ptr, sizeof(next));
+                deallocate((T*)ptr, 1);
+                ptr = next;
+
+                if constexpr (stats_enabled)
+                {
+                    ++counters.remote_deallocations;
+                }
+            }
+
+            header = next_header;
+        }
+    }
+
+    template <typename T>
+    allocator_t<T>::allocator_t() noexcept
+    {
+        shared_pool::init();
+    }
+
+    template <typename T>
+    [[nodiscard]]
+    auto allocator_t<T>::allocate(size_t n) -> T*
+    {
+        auto ptr = (T*)shared_pool::allocate(n);
+        if constexpr (trace_enabled)
+        {
+            impl::tracer_t::record(trace_op_t::allocate, ptr, sizeof(T) * n, alignof(T));
+        }
+        return ptr;
+    }
+
+    template <typename T>
+    auto allocator_t<T>::deallocate(T* ptr, size_t n) noexcept -> void_t
+    {
+        if constexpr (trace_enabled)
+        {
+            impl::tracer_t::record(trace_op_t::deallocate, ptr, sizeof(T) * n, alignof(T));
+        }
+        shared_pool::deallocate((storage_type*)ptr, n);
+    }
+
+    template <typename T>
+    auto allocator_t<T>::allocate_bulk(T** out, size_t count) -> void_t
+    {
+        shared_pool::allocate_bulk((storage_type**)out, count);
+        if constexpr (trace_enabled)
+        {
+            for (auto i = size_t(0); i < count; ++i)
+            {
+                impl::tracer_t::record(trace_op_t::allocate, out[i], sizeof(T), alignof(T));
+            }
+        }
+    }
+
+    template <typename T>
+    auto allocator_t<T>::deallocate_bulk(T* const* ptrs, size_t count) noexcept -> void_t
+    {
+        if constexpr (trace_enabled)
+        {
+            for (auto i = size_t(0); i < count; ++i)
+            {
+                impl::tracer_t::record(trace_op_t::deallocate, ptrs[i], sizeof(T), alignof(T));
+            }
+        }
+        shared_pool::deallocate_bulk((storage_type* const*)ptrs, count);
+    }
+
+    template <typename T>
+    auto allocator_t<T>::trim(size_t retain, trim_t mode) -> size_t
+    {
+        return shared_pool::trim(retain, mode);
+    }
+
+    template <typename T>
+    auto allocator_t<T>::stats() -> pool_stats_t
+    {
+        return shared_pool::stats();
+    }
+
+    template <typename T>
+    auto release_all() -> size_t
+    {
+        return impl::shared_pool_t<impl::storage_t<T>>::release();
+    }
+
+    inline auto shutdown() -> size_t
+    {
+        lock_guard_t<mutex_t> lg(impl::shared_pools_mutex);
+        auto released = size_t(0);
+        for (auto release_blocks : impl::shared_pool_releases)
+        {
+            released += release_blocks();
+        }
+        return released;
+    }
+
+    inline auto start_trace(const char* path) -> bool_t
+    {
+        return impl::tracer_t::start(path);
+    }
+
+    inline auto stop_trace() -> void_t
+    {
+        impl::tracer_t::stop();
+    }
+
+    template <typename BlockProvider>
+    basic_pool_resource_t<BlockProvider>::basic_pool_resource_t() noexcept :
+        upstream(std::pmr::get_default_resource())
+    {
+    }
+
+    template <typename BlockProvider>
+    basic_pool_resource_t<BlockProvider>::basic_pool_resource_t(std::pmr::memory_resource* upstream) noexcept :
+        upstream(upstream)
+    {
+    }
+
+    template <typename BlockProvider>
+    basic_pool_resource_t<BlockProvider>::basic_pool_resource_t(const BlockProvider& provider, std::pmr::memory_resource* upstream) :
+        basic_pool_resource_t(provider, upstream, class_indices{})
+    {
+    }
+
+    template <typename BlockProvider>
+    template <size_t... Indices>
+    basic_pool_resource_t<BlockProvider>::basic_pool_resource_t(const BlockProvider& provider, std::pmr::memory_resource* upstream,
+        std::index_sequence<Indices...>) :
+        upstream(upstream),
+        pools(((void_t)Indices, provider)...)
+    {
+    }
+
+    template <typename BlockProvider>
+    auto basic_pool_resource_t<BlockProvider>::upstream_resource() const noexcept -> std::pmr::memory_resource*
+    {
+        return upstream;
+    }
+
+    template <typename BlockProvider>
+    auto basic_pool_resource_t<BlockProvider>::trim(size_t retain, trim_t mode) -> size_t
+    {
+        return std::apply([&](auto&... pool) { return (pool.trim(retain, mode) + ...); }, pools);
+    }
+
+    template <typename BlockProvider>
+    auto basic_pool_resource_t<BlockProvider>::reset() -> void_t
+    {
+        std::apply([](auto&... pool) { (pool.reset(), ...); }, pools);
+    }
+
+    template <typename BlockProvider>
+    constexpr auto basic_pool_resource_t<BlockProvider>::pooled(size_t bytes, size_t alignment) -> bool_t
+    {
+        return bytes <= max_pooled_size && alignment <= impl::size_class_alignment(impl::size_class(bytes));
+    }
+
+    template <typename BlockProvider>
+    template <size_t... Indices>
+    auto basic_pool_resource_t<BlockProvider>::allocate_pooled(size_t index, std::index_sequence<Indices...>) -> void_t*
+    {
+        using allocate_t = auto (*)(pools_type&) -> void_t*;
+        static constexpr allocate_t allocate[] = {
+            [](pools_type& pools) -> void_t* { return std::get<Indices>(pools).allocate(1); }...
+        };
+
+        return allocate[index](pools);
+    }
+
+    template <typename BlockProvider>
+    template <size_t... Indices>
+    auto basic_pool_resource_t<BlockProvider>::deallocate_pooled(void_t* ptr, size_t index, std::index_sequence<Indices...>) -> void_t
+    {
+        using deallocate_t = auto (*)(pools_type&, void_t*) -> void_t;
+        static constexpr deallocate_t deallocate[] = {
+            [](pools_type& pools, void_t* ptr) { std::get<Indices>(pools).deallocate((typename class_pool_t<Indices>::value_type*)ptr, 1); }...
+        };
+
+        deallocate[index](pools, ptr);
+    }
+
+    template <typename BlockProvider>
+    auto basic_pool_resource_t<BlockProvider>::do_allocate(size_t bytes, size_t alignment) -> void_t*
+    {
+        if (!pooled(bytes, alignment))
+        {
+            return upstream->allocate(bytes, alignment);
+        }
+
+        return allocate_pooled(impl::size_class_index(bytes), class_indices{});
+    }
+
+    template <typename BlockProvider>
+    auto basic_pool_resource_t<BlockProvider>::do_deallocate(void_t* ptr, size_t bytes, size_t alignment) -> void_t
+    {
+        if (!pooled(bytes, alignment))
+        {
+            upstream->deallocate(ptr, bytes, alignment);
+            return;
+        }
+
+        deallocate_pooled(ptr, impl::size_class_index(bytes), class_indices{});
+    }
+
+    template <typename BlockProvider>
+    auto basic_pool_resource_t<BlockProvider>::do_is_equal(const std::pmr::memory_resource& other) const noexcept -> bool_t
+    {
+        return this == &other;
+    }
+
+    template <typename BlockProvider>
+    template <typename T>
+    auto basic_pool_resource_t<BlockProvider>::allocate_object(size_t n) -> T*
+    {
+        if constexpr (pooled(sizeof(T), alignof(T)))
+        {
+            if (n == 1)
+            {
+                return (T*)std::get<impl::size_class_index(sizeof(T))>(pools).allocate(1);
+            }
+        }
+
+        if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+        {
+            throw std::bad_array_new_length();
+        }
+        return (T*)basic_pool_resource_t::do_allocate(n * sizeof(T), alignof(T));
+    }
+
+    template <typename BlockProvider>
+    template <typename T>
+    auto basic_pool_resource_t<BlockProvider>::deallocate_object(T* ptr, size_t n) -> void_t
+    {
+        if constexpr (pooled(sizeof(T), alignof(T)))
+        {
+            if (n == 1)
+            {
+                using pool_type = std::tuple_element_t<impl::size_class_index(sizeof(T)), pools_type>;
+                std::get<impl::size_class_index(sizeof(T))>(pools).deallocate((typename pool_type::value_type*)ptr, 1);
+                return;
+            }
+        }
+
+        basic_pool_resource_t::do_deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+
+    template <typename T, bool_t Propagate, typename Resource>
+    pool_allocator_t<T, Propagate, Resource>::pool_allocator_t(Resource* resource) noexcept :
+        pool(resource)
+    {
+    }
+
+    template <typename T, bool_t Propagate, typename Resource>
+    [[nodiscard]]
+    auto pool_allocator_t<T, Propagate, Resource>::allocate(size_t n) -> T*
+    {
+        return pool->template allocate_object<T>(n);
+    }
+
+    template <typename T, bool_t Propagate, typename Resource>
+    auto pool_allocator_t<T, Propagate, Resource>::deallocate(T* ptr, size_t n) noexcept -> void_t
+    {
+        pool->deallocate_object(ptr, n);
+    }
+
+    template <typename T, bool_t Propagate, typename Resource>
+    auto pool_allocator_t<T, Propagate, Resource>::resource() const noexcept -> Resource*
+    {
+        return pool;
+    }
+
+    template <typename T, typename U, bool_t Propagate, typename Resource>
+    auto operator==(const pool_allocator_t<T, Propagate, Resource>& a, const pool_allocator_t<U, Propagate, Resource>& b) noexcept -> bool_t
+    {
+        return a.resource() == b.resource();
+    }
 
-    private:
-        inline static multi_pool_t<T>* multi_pool = nullptr;
-        inline static mutex_t mutex;
-    };
+    template <typename T>
+    [[nodiscard]]
+    auto thread_heap_allocator_t<T>::allocate(size_t n) -> T*
+    {
+        return (T*)thread_heaps::allocate(n);
+    }
 
+    template <typename T>
+    auto thread_heap_allocator_t<T>::deallocate(T* ptr, size_t n) noexcept -> void_t
+    {
+        thread_heaps::deallocate((storage_type*)ptr, n);
+    }
 
-    template <typename T, typename WordType>
-        requires std::unsigned_integral<WordType>
-    auto pool_t<T, WordType>::init() -> void_t
+    template <typename T, typename U>
+    auto operator==(const thread_heap_allocator_t<T>& a, const thread_heap_allocator_t<U>& b) noexcept -> bool_t
     {
-        unused_words = ~WordType(0);
+        return true;
+    }
+}
 
-        for (auto i = 0u; i < word_bits; ++i)
+
+namespace mpa::impl
+{
+    template <typename Tag, size_t Count>
+    auto sharded_counters_t<Tag, Count>::acquire_shard() -> shard_t*
+    {
+        lock_guard_t<mutex_t> lg(mutex);
+        if (free_shards.empty())
         {
-            unallocated_slots[i] = ~WordType(0);
+            shards.push_back(std::make_unique<shard_t>());
+            handle.shard = shards.back().get();
+        }
+        else
+        {
+            handle.shard = free_shards.back();
+            free_shards.pop_back();
         }
-    }
 
+        local_shard = handle.shard;
+        return local_shard;
+    }
 
-    template <typename T, typename WordType>
-        requires std::unsigned_integral<WordType>
-    auto pool_t<T, WordType>::allocate() -> T*
+    template <typename Tag, size_t Count>
+    auto sharded_counters_t<Tag, Count>::add(size_t counter, u64_t n) -> void_t
     {
-        auto bucket = impl::ctz(unused_words);
-        auto slot = impl::ctz(unallocated_slots[bucket]);
-
-        impl::clear_bit(unallocated_slots[bucket], slot);
-        if (!unallocated_slots[bucket])
+        auto shard = local_shard;
+        if (!shard) [[unlikely]]
         {
-            impl::clear_bit(unused_words, bucket);
+            if (exited)
+            {
+                exited_shard.counters[counter].fetch_add(n, std::memory_order_relaxed);
+                return;
+            }
+            shard = acquire_shard();
         }
 
-        return &data[bucket * word_bits + slot];
+        auto& value = shard->counters[counter];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
     }
 
+    template <typename Tag, size_t Count>
+    auto sharded_counters_t<Tag, Count>::sum(size_t counter) -> u64_t
+    {
+        lock_guard_t<mutex_t> lg(mutex);
+        auto total = exited_shard.counters[counter].load(std::memory_order_relaxed);
+        for (auto& shard : shards)
+        {
+            total += shard->counters[counter].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
 
-    template <typename T, typename WordType>
-        requires std::unsigned_integral<WordType>
-    auto pool_t<T, WordType>::deallocate(T* ptr) -> void_t
+    template <typename Tag, size_t Count>
+    sharded_counters_t<Tag, Count>::shard_handle_t::~shard_handle_t()
     {
-        auto index = uint32_t(ptr - data);
-        auto bucket = index / word_bits;
-        auto slot = index % word_bits;
+        if (shard)
+        {
+            lock_guard_t<mutex_t> lg(mutex);
+            free_shards.push_back(shard);
+        }
+        shard = nullptr;
+        local_shard = nullptr;
+        exited = true;
+    }
 
-        impl::set_bit(unallocated_slots[bucket], slot);
-        if (unallocated_slots[bucket] == ~WordType(0))
+    inline auto counting_mutex_t::lock() -> void_t
+    {
+        if constexpr (!stats_enabled)
         {
-            impl::set_bit(unused_words, bucket);
+            mutex.lock();
+            return;
+        }
+
+        if (held.load(std::memory_order_relaxed)) [[unlikely]]
+        {
+            lock_contended();
+        }
+        else
+        {
+            mutex.lock();
         }
+        acquired();
     }
 
+    inline auto counting_mutex_t::acquired() -> void_t
+    {
+        held.store(true, std::memory_order_relaxed);
+        if (++acquisitions % hold_sample_interval == 0) [[unlikely]]
+        {
+            hold_start = std::chrono::steady_clock::now();
+        }
+    }
 
-    template <typename T, typename WordType>
-        requires std::unsigned_integral<WordType>
-    auto pool_t<T, WordType>::full() -> bool_t
+    inline auto counting_mutex_t::lock_contended() -> void_t
     {
-        return !unused_words;
+        auto start = std::chrono::steady_clock::now();
+        mutex.lock();
+        ++waits;
+        wait_ns += u64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
     }
 
-    template <typename T>
-    multi_pool_t<T>::multi_pool_t()
+    inline auto counting_mutex_t::unlock() -> void_t
     {
-        new_block();
+        if constexpr (stats_enabled)
+        {
+            if (hold_start != std::chrono::steady_clock::time_point()) [[unlikely]]
+            {
+                auto held_for = std::chrono::steady_clock::now() - hold_start;
+                hold_ns += u64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(held_for).count()) * hold_sample_interval;
+                hold_start = {};
+            }
+            held.store(false, std::memory_order_relaxed);
+        }
+        mutex.unlock();
     }
 
-    template <typename T>
-    multi_pool_t<T>::~multi_pool_t()
+    inline auto counting_mutex_t::try_lock() -> bool_t
     {
-        for (auto memory_block : memory_blocks)
+        if (!mutex.try_lock())
+        {
+            return false;
+        }
+
+        if constexpr (stats_enabled)
         {
-            free(memory_block.ptr);
+            acquired();
         }
+        return true;
     }
 
-    template <typename T>
-    auto multi_pool_t<T>::new_block() -> void_t
+    template <typename Storage>
+    shared_pool_t<Storage>::lifetime_t::lifetime_t()
     {
+        new (storage) pool_type;
+        lock_guard_t<mutex_t> lg(shared_pools_mutex);
+        shared_pool_releases.push_back(&release_blocks);
+    }
 
-        impl::block_t<word_type> memory_block = { malloc(sizeof(pool_t<T>) * pools_in_block), ~word_type(0) };
-        memory_blocks.push_back(memory_block);
-        auto pools = (pool_t<T>*) memory_block.ptr;
+    template <typename Storage>
+    shared_pool_t<Storage>::lifetime_t::~lifetime_t()
+    {
+        release_blocks();
+    }
+
+    template <typename Storage>
+    auto shared_pool_t<Storage>::init() -> void_t
+    {
+        // Statics whose constructors call init are destroyed before lifetime.
+        static lifetime_t lifetime;
+    }
+
+    template <typename Storage>
+    auto shared_pool_t<Storage>::pool() -> pool_type*
+    {
+        return std::launder(reinterpret_cast<pool_type*>(storage));
+    }
+
+    template <typename Storage>
+    auto shared_pool_t<Storage>::allocate(size_t n) -> Storage*
+    {
+        if constexpr (stats_enabled)
+        {
+            counters::add(allocations, n);
+        }
 
-        for (auto i = 0; i < pools_in_block; ++i)
+        // The thread cache only holds single slots, runs always come from the shared pool.
+        if constexpr (thread_cache_size > 0)
         {
-            pools[i].init();
+            if (n == 1 && !exited)
+            {
+                auto& cache = thread_cache;
+                if (!cache.count)
+                {
+                    lock_guard_t<counting_mutex_t> lg(mutex);
+                    pool()->allocate_bulk(cache.slots.data(), thread_cache_batch);
+                    cache.count = thread_cache_batch;
+                }
+                return cache.slots[--cache.count];
+            }
         }
+
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        return pool()->allocate(n);
     }
 
-    template <typename T>
-    auto multi_pool_t<T>::allocate(size_t n) -> T*
+    template <typename Storage>
+    auto shared_pool_t<Storage>::deallocate(Storage* ptr, size_t n) -> void_t
     {
-        assert(n == 1);
+        if constexpr (stats_enabled)
+        {
+            counters::add(deallocations, n);
+        }
 
-        for (auto i = memory_blocks.size() - 1; i < memory_blocks.size(); --i)
+        if constexpr (thread_cache_size > 0)
         {
-            auto& memory_block = memory_blocks[i];
-            if (memory_block.unmaxed_pools)
+            if (n == 1 && !exited)
             {
-                auto pool_idx = impl::ctz(memory_block.unmaxed_pools);
-                auto pool = (pool_t<T>*) memory_block.ptr + pool_idx;
-                auto result = pool->allocate();
-                if (pool->full())
+                auto& cache = thread_cache;
+                if (cache.count == thread_cache_size)
                 {
-                    impl::clear_bit(memory_block.unmaxed_pools, pool_idx);
+                    lock_guard_t<counting_mutex_t> lg(mutex);
+                    cache.count -= thread_cache_batch;
+                    pool()->deallocate_bulk(cache.slots.data() + cache.count, thread_cache_batch);
                 }
-                return result;
+                cache.slots[cache.count++] = ptr;
+                return;
             }
         }
 
-        new_block();
-        return ((pool_t<T>*)memory_blocks.back().ptr)->allocate();
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        pool()->deallocate(ptr, n);
+    }
+
+    template <typename Storage>
+    shared_pool_t<Storage>::thread_cache_t::thread_cache_t()
+    {
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        next = thread_caches;
+        if (next)
+        {
+            next->previous = this;
+        }
+        thread_caches = this;
+    }
+
+    template <typename Storage>
+    shared_pool_t<Storage>::thread_cache_t::~thread_cache_t()
+    {
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        pool()->deallocate_bulk(slots.data(), count);
+        count = 0;
+
+        (previous ? previous->next : thread_caches) = next;
+        if (next)
+        {
+            next->previous = previous;
+        }
+        exited = true;
+    }
+
+    template <typename Storage>
+    auto shared_pool_t<Storage>::allocate_bulk(Storage** out, size_t count) -> void_t
+    {
+        if constexpr (stats_enabled)
+        {
+            counters::add(allocations, count);
+        }
 
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        pool()->allocate_bulk(out, count);
     }
 
-    template <typename T>
-    auto multi_pool_t<T>::deallocate(T* ptr, size_t n) -> void_t
+    template <typename Storage>
+    auto shared_pool_t<Storage>::deallocate_bulk(Storage* const* ptrs, size_t count) -> void_t
     {
-        for (auto i = memory_blocks.size() - 1; i < memory_blocks.size(); --i)
+        if constexpr (stats_enabled)
         {
-            auto& memory_block = memory_blocks[i];
-            auto pool_size = sizeof(pool_t<T>);
-            size_t pool_idx = ((u8_t*)ptr - (u8_t*)memory_block.ptr) / pool_size;
+            counters::add(deallocations, count);
+        }
+
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        pool()->deallocate_bulk(ptrs, count);
+    }
+
+    template <typename Storage>
+    auto shared_pool_t<Storage>::trim(size_t retain, trim_t mode) -> size_t
+    {
+        init();
 
-            if (pool_idx < pools_in_block)
+        if constexpr (thread_cache_size > 0)
+        {
+            if (!exited)
             {
-                assert((u8_t*)ptr - (u8_t*)((pool_t<T>*) memory_block.ptr + pool_idx) < pool_size);
-                auto pool = (pool_t<T>*) memory_block.ptr + pool_idx;
-                impl::set_bit(memory_block.unmaxed_pools, pool_idx);
-                pool->deallocate(ptr);
-                break;
+                // The first use of the cache registers it, which takes the mutex.
+                auto& cache = thread_cache;
+                lock_guard_t<counting_mutex_t> lg(mutex);
+                pool()->deallocate_bulk(cache.slots.data(), cache.count);
+                cache.count = 0;
+                return pool()->trim(retain, mode);
             }
         }
+
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        return pool()->trim(retain, mode);
     }
 
-    template <typename T>
-    allocator_t<T>::allocator_t() noexcept
+    template <typename Storage>
+    auto shared_pool_t<Storage>::stats() -> pool_stats_t
     {
-        if (!multi_pool)
+        init();
+
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        auto stats = pool()->stats();
+        stats.counters.lock_waits = mutex.waits;
+        stats.counters.lock_wait_ns = mutex.wait_ns;
+        stats.counters.lock_acquisitions = mutex.acquisitions;
+        stats.counters.lock_hold_ns = mutex.hold_ns;
+
+        if constexpr (stats_enabled)
         {
-            multi_pool = new multi_pool_t<T>;
+            stats.counters.allocations = counters::sum(allocations);
+            stats.counters.deallocations = counters::sum(deallocations);
         }
+        return stats;
     }
 
-    template <typename T>
-    [[nodiscard]]
-    auto allocator_t<T>::allocate(size_t n) -> T*
+    template <typename Storage>
+    auto shared_pool_t<Storage>::release() -> size_t
+    {
+        init();
+        return release_blocks();
+    }
+
+    template <typename Storage>
+    auto shared_pool_t<Storage>::release_blocks() -> size_t
+    {
+        lock_guard_t<counting_mutex_t> lg(mutex);
+        if constexpr (thread_cache_size > 0)
+        {
+            for (auto cache = thread_caches; cache; cache = cache->next)
+            {
+                pool()->deallocate_bulk(cache->slots.data(), cache->count);
+                cache->count = 0;
+            }
+        }
+
+        return pool()->trim(0, trim_t::release);
+    }
+
+    inline tracer_t::thread_buffer_t::thread_buffer_t()
     {
-        using namespace impl;
         lock_guard_t<mutex_t> lg(mutex);
-        return multi_pool->allocate(n);
+        thread = thread_count++;
+        next = thread_buffers;
+        if (next)
+        {
+            next->previous = this;
+        }
+        thread_buffers = this;
     }
 
-    template <typename T>
-    auto allocator_t<T>::deallocate(T* ptr, size_t n) noexcept -> void_t
+    inline tracer_t::thread_buffer_t::~thread_buffer_t()
+    {
+        // The exiting thread needs no new buffer, an empty one goes back to the spares.
+        lock_guard_t<mutex_t> lg(mutex);
+        if (buffer && buffer->chunk.count)
+        {
+            queue_buffer(buffer);
+        }
+        else if (buffer)
+        {
+            spare_buffers.push_back(buffer);
+        }
+        buffer = nullptr;
+        exited = true;
+
+        (previous ? previous->next : thread_buffers) = next;
+        if (next)
+        {
+            next->previous = previous;
+        }
+    }
+
+    inline auto tracer_t::start(const char* path) -> bool_t
     {
-        using namespace impl;
         lock_guard_t<mutex_t> lg(mutex);
-        multi_pool->deallocate(ptr, n);
+        if (active.load(std::memory_order_relaxed) || writer.joinable())
+        {
+            return false;
+        }
+
+        file = fopen(path, "wb");
+        if (!file)
+        {
+            return false;
+        }
+
+        // A trace still running at exit is written out, and the writer is not destroyed while running.
+        [[maybe_unused]] static auto stop_at_exit = std::atexit(stop);
+
+        stopping = false;
+        start_time = std::chrono::steady_clock::now();
+        writer = std::thread(write_buffers);
+        active.store(true, std::memory_order_release);
+        return true;
+    }
+
+    inline auto tracer_t::stop() -> void_t
+    {
+        {
+            lock_guard_t<mutex_t> lg(mutex);
+            if (!writer.joinable())
+            {
+                return;
+            }
+
+            active.store(false, std::memory_order_relaxed);
+            for (auto local = thread_buffers; local; local = local->next)
+            {
+                if (local->buffer && local->buffer->chunk.count)
+                {
+                    local->buffer = swap_buffer(local->buffer, local->thread);
+                }
+            }
+            stopping = true;
+        }
+
+        buffers_written.notify_one();
+        writer.join();
+        fclose(file);
+        file = nullptr;
+    }
+
+    inline auto tracer_t::record(trace_op_t op, const void_t* ptr, size_t size, size_t alignment) -> void_t
+    {
+        if (!active.load(std::memory_order_acquire) || exited)
+        {
+            return;
+        }
+
+        auto& local = thread_buffer;
+        auto now = std::chrono::steady_clock::now();
+        if (!local.buffer) [[unlikely]]
+        {
+            lock_guard_t<mutex_t> lg(mutex);
+            local.buffer = swap_buffer(nullptr, local.thread);
+        }
+
+        auto buffer = local.buffer;
+        auto time = u64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_time).count());
+        buffer->records[buffer->chunk.count++] = { time, u64_t(uintptr_t(ptr)), u32_t(size), u16_t(alignment), op, 0 };
+
+        if (buffer->chunk.count == buffer_records)
+        {
+            lock_guard_t<mutex_t> lg(mutex);
+            local.buffer = swap_buffer(buffer, local.thread);
+        }
+    }
+
+    inline auto tracer_t::swap_buffer(buffer_t* buffer, u32_t thread) -> buffer_t*
+    {
+        if (buffer)
+        {
+            queue_buffer(buffer);
+        }
+
+        if (spare_buffers.empty())
+        {
+            buffers.push_back(std::make_unique<buffer_t>());
+            spare_buffers.push_back(buffers.back().get());
+        }
+
+        auto empty = spare_buffers.back();
+        spare_buffers.pop_back();
+        empty->chunk = { thread, 0 };
+        return empty;
+    }
+
+    inline auto tracer_t::queue_buffer(buffer_t* buffer) -> void_t
+    {
+        full_buffers.push_back(buffer);
+        buffers_written.notify_one();
+    }
+
+    inline auto tracer_t::write_buffers() -> void_t
+    {
+        std::unique_lock<mutex_t> lock(mutex);
+        while (true)
+        {
+            buffers_written.wait(lock, []() { return stopping || !full_buffers.empty(); });
+            if (full_buffers.empty())
+            {
+                return;
+            }
+
+            auto written = std::move(full_buffers);
+            full_buffers.clear();
+            lock.unlock();
+
+            for (auto buffer : written)
+            {
+                fwrite(&buffer->chunk, sizeof(trace_chunk_t), 1, file);
+                fwrite(buffer->records, sizeof(trace_record_t), buffer->chunk.count, file);
+            }
+
+            lock.lock();
+            spare_buffers.insert(spare_buffers.end(), written.begin(), written.end());
+        }
+    }
+
+    template <typename Storage>
+    auto thread_heaps_t<Storage>::local_heap() -> heap_t*
+    {
+        if (!thread_heap)
+        {
+            lock_guard_t<mutex_t> lg(mutex);
+            if (abandoned_heaps.empty())
+            {
+                thread_heap = new heap_t;
+            }
+            else
+            {
+                thread_heap = abandoned_heaps.back();
+                abandoned_heaps.pop_back();
+            }
+            // Registers the destructor that parks the heap again.
+            [[maybe_unused]] auto& registered = handle;
+        }
+
+        return thread_heap;
+    }
+
+    template <typename Storage>
+    auto thread_heaps_t<Storage>::allocate(size_t n) -> Storage*
+    {
+        if (exited) [[unlikely]]
+        {
+            // No thread uses a parked heap while the mutex is held, so the exiting thread borrows one instead of
+            // keeping a heap nobody would park again.
+            lock_guard_t<mutex_t> lg(mutex);
+            if (abandoned_heaps.empty())
+            {
+                abandoned_heaps.push_back(new heap_t);
+            }
+            auto heap = abandoned_heaps.back();
+            heap->collect_remote();
+            return heap->allocate(n);
+        }
+
+        auto heap = local_heap();
+        heap->collect_remote();
+        return heap->allocate(n);
+    }
+
+    template <typename Storage>
+    auto thread_heaps_t<Storage>::deallocate(Storage* ptr, size_t n) -> void_t
+    {
+        // Arrays longer than max_contiguous have no block, deallocate_remote frees them. So are the slots freed
+        // after the thread parked its heap.
+        if (n <= heap_t::max_contiguous && thread_heap && heap_t::owner_of(ptr) == thread_heap)
+        {
+            thread_heap->deallocate(ptr, n);
+        }
+        else
+        {
+            heap_t::deallocate_remote(ptr, n);
+        }
+    }
+
+    template <typename Storage>
+    thread_heaps_t<Storage>::heap_handle_t::~heap_handle_t()
+    {
+        // The handle may be constructed along with other thread_locals of the thread before it takes a heap.
+        if (thread_heap)
+        {
+            lock_guard_t<mutex_t> lg(mutex);
+            abandoned_heaps.push_back(thread_heap);
+            thread_heap = nullptr;
+        }
+        exited = true;
     }
 }
 
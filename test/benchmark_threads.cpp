@@ -0,0 +1,310 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Scaling of the allocators from one thread to all cores. Every operation is timed on its own, so the
+// latencies include the cost of reading the clock. Lock counters need MPA_STATS, which is enabled here.
+#if !defined(MPA_STATS)
+    #define MPA_STATS 1
+#endif
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <cstdint>
+#include <map>
+#include <list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <atomic>
+#include <algorithm>
+
+#include "../multi_pool_alloc.hpp"
+
+
+static constexpr uint64_t ops_per_thread = uint64_t(1) << 20;
+static constexpr uint64_t keys_per_thread = uint64_t(1) << 12;
+static constexpr uint64_t list_length = uint64_t(1) << 10;
+
+
+// mpa::allocator_t that remembers which instantiation a container rebound it to, so the lock counters of
+// that shared pool can be read.
+inline std::atomic<mpa::pool_stats_t (*)()> node_stats = nullptr;
+
+template <typename T>
+struct tracked_allocator_t : mpa::allocator_t<T>
+{
+    template <typename U>
+    struct rebind
+    {
+        using other = tracked_allocator_t<U>;
+    };
+
+    tracked_allocator_t() noexcept = default;
+
+    template <typename U>
+    tracked_allocator_t(const tracked_allocator_t<U>& other) noexcept
+    {
+    }
+
+    auto allocate(size_t n) -> T*
+    {
+        // Only read after the first call, so threads do not write a shared line.
+        if (node_stats.load(std::memory_order_relaxed) != &mpa::allocator_t<T>::stats)
+        {
+            node_stats.store(&mpa::allocator_t<T>::stats, std::memory_order_relaxed);
+        }
+        return mpa::allocator_t<T>::allocate(n);
+    }
+};
+
+
+struct run_result_t
+{
+    uint64_t ops = 0;
+    double seconds = 0;
+    std::vector<uint32_t> latencies;
+    mpa::pool_counters_t lock_counters;
+};
+
+
+auto lock_counters() -> mpa::pool_counters_t
+{
+    auto stats = node_stats.load(std::memory_order_relaxed);
+    return stats ? stats().counters : mpa::pool_counters_t();
+}
+
+
+template <typename Function>
+auto timed_op(std::vector<uint32_t>& latencies, Function function) -> void
+{
+    auto start = std::chrono::steady_clock::now();
+    function();
+    auto end = std::chrono::steady_clock::now();
+    latencies.push_back(uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+}
+
+
+// Runs body(t, latencies) on thread_count threads released at the same time and collects their latencies.
+template <typename Body>
+auto run_threads(uint32_t thread_count, Body body) -> run_result_t
+{
+    run_result_t result;
+    auto before = lock_counters();
+
+    std::vector<std::vector<uint32_t>> latencies(thread_count);
+    std::atomic<uint32_t> ready = 0;
+    std::atomic<bool> go = false;
+    std::vector<std::thread> threads;
+
+    for (auto t = 0u; t < thread_count; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            latencies[t].reserve(ops_per_thread * 2);
+            ++ready;
+            while (!go.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            body(t, latencies[t]);
+        });
+    }
+
+    while (ready.load() != thread_count)
+    {
+        std::this_thread::yield();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    for (auto& thread_latencies : latencies)
+    {
+        result.latencies.insert(result.latencies.end(), thread_latencies.begin(), thread_latencies.end());
+    }
+    result.ops = result.latencies.size();
+
+    auto after = lock_counters();
+    result.lock_counters.lock_waits = after.lock_waits - before.lock_waits;
+    result.lock_counters.lock_wait_ns = after.lock_wait_ns - before.lock_wait_ns;
+    result.lock_counters.lock_acquisitions = after.lock_acquisitions - before.lock_acquisitions;
+    result.lock_counters.lock_hold_ns = after.lock_hold_ns - before.lock_hold_ns;
+    return result;
+}
+
+
+// Every thread inserts and erases random keys of a map of its own.
+template <template <typename> typename Allocator>
+auto run_maps(uint32_t thread_count) -> run_result_t
+{
+    using map_t = std::map<uint64_t, uint64_t, std::less<uint64_t>, Allocator<std::pair<const uint64_t, uint64_t>>>;
+
+    // Allocating a node first makes the lock counters those of the node pool, if the allocator has one.
+    node_stats.store(nullptr);
+    map_t(std::initializer_list<std::pair<const uint64_t, uint64_t>>{ { 0, 0 } });
+
+    return run_threads(thread_count, [](uint32_t t, std::vector<uint32_t>& latencies)
+    {
+        std::mt19937_64 mt(t);
+        map_t map;
+
+        for (auto i = uint64_t(0); i < ops_per_thread; ++i)
+        {
+            auto key = mt() % keys_per_thread;
+            auto it = map.find(key);
+            if (it == map.end())
+            {
+                timed_op(latencies, [&]() { map.emplace(key, key); });
+            }
+            else
+            {
+                timed_op(latencies, [&]() { map.erase(it); });
+            }
+        }
+    });
+}
+
+
+// Thread 0 frees the list nodes allocated by all other threads.
+template <template <typename> typename Allocator>
+auto run_cross_thread(uint32_t thread_count) -> run_result_t
+{
+    using list_t = std::list<uint64_t, Allocator<uint64_t>>;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::queue<list_t> queue;
+    auto producers = thread_count - 1;
+    auto lists_per_producer = ops_per_thread / list_length;
+    node_stats.store(nullptr);
+    list_t(1);
+
+    return run_threads(thread_count, [&](uint32_t t, std::vector<uint32_t>& latencies)
+    {
+        if (t == 0)
+        {
+            for (auto i = uint64_t(0); i < producers * lists_per_producer; ++i)
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_cv.wait(lock, [&]() { return !queue.empty(); });
+                auto list = std::move(queue.front());
+                queue.pop();
+                lock.unlock();
+
+                while (!list.empty())
+                {
+                    timed_op(latencies, [&]() { list.pop_front(); });
+                }
+            }
+            return;
+        }
+
+        for (auto i = uint64_t(0); i < lists_per_producer; ++i)
+        {
+            list_t list;
+            for (auto j = uint64_t(0); j < list_length; ++j)
+            {
+                timed_op(latencies, [&]() { list.push_back(j); });
+            }
+
+            std::lock_guard<std::mutex> lg(queue_mutex);
+            queue.push(std::move(list));
+            queue_cv.notify_one();
+        }
+    });
+}
+
+
+auto report(const char* allocator, const char* scenario, uint32_t thread_count, run_result_t& result) -> void
+{
+    std::sort(result.latencies.begin(), result.latencies.end());
+    auto percentile = [&](double p)
+    {
+        return result.latencies.empty() ? 0 : result.latencies[size_t(p * double(result.latencies.size() - 1))];
+    };
+
+    std::cout << std::left << std::setw(32) << allocator << std::setw(14) << scenario << std::right
+        << std::setw(8) << thread_count
+        << std::setw(12) << std::fixed << std::setprecision(2) << result.ops / result.seconds / 1E6
+        << std::setw(8) << percentile(0.5) << std::setw(8) << percentile(0.99) << std::setw(8) << percentile(0.999);
+
+    auto& counters = result.lock_counters;
+    if (counters.lock_acquisitions)
+    {
+        std::cout << std::setw(12) << counters.lock_acquisitions << std::setw(10) << counters.lock_waits
+            << std::setw(12) << std::setprecision(3) << counters.lock_wait_ns / 1E6
+            << std::setw(12) << counters.lock_hold_ns / 1E6
+            << std::setw(10) << std::setprecision(1) << double(counters.lock_hold_ns) / counters.lock_acquisitions;
+    }
+    std::cout << std::endl;
+}
+
+
+template <template <typename> typename Allocator>
+auto run_all(const char* allocator, const std::vector<uint32_t>& thread_counts) -> void
+{
+    for (auto thread_count : thread_counts)
+    {
+        auto result = run_maps<Allocator>(thread_count);
+        report(allocator, "map", thread_count, result);
+    }
+
+    // The cross thread scenario needs a producer besides the consumer.
+    for (auto thread_count : thread_counts)
+    {
+        auto result = run_cross_thread<Allocator>(std::max(2u, thread_count));
+        report(allocator, "cross_thread", std::max(2u, thread_count), result);
+    }
+}
+
+
+int main()
+{
+    auto cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint32_t> thread_counts;
+    for (auto thread_count = 1u; thread_count < cores; thread_count *= 2)
+    {
+        thread_counts.push_back(thread_count);
+    }
+    thread_counts.push_back(cores);
+
+    std::cout << std::left << std::setw(32) << "allocator" << std::setw(14) << "scenario" << std::right
+        << std::setw(8) << "threads" << std::setw(12) << "Mops/s"
+        << std::setw(8) << "p50 ns" << std::setw(8) << "p99 ns" << std::setw(8) << "p999 ns"
+        << std::setw(12) << "locks" << std::setw(10) << "waits" << std::setw(12) << "wait ms"
+        << std::setw(12) << "hold ms" << std::setw(10) << "hold ns" << std::endl;
+
+    run_all<tracked_allocator_t>("mpa::allocator_t", thread_counts);
+    run_all<mpa::thread_heap_allocator_t>("mpa::thread_heap_allocator_t", thread_counts);
+    run_all<std::allocator>("std::allocator", thread_counts);
+}
@@ -0,0 +1,211 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+// Replays a trace recorded with MPA_TRACE against several allocators, on one thread in the order of the
+// timestamps. Build it with -DMPA_PLACEMENT=... or -DMPA_GEOMETRY=... to see how the mpa pools would do
+// with other settings.
+//
+//     replay_trace <trace file> [repetitions]
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <memory_resource>
+#include <algorithm>
+
+#include "../multi_pool_alloc.hpp"
+
+
+struct replay_op_t
+{
+    uint32_t size;
+    uint16_t alignment;
+    mpa::trace_op_t op;
+    // Index of the object in the replay's table of live pointers.
+    uint32_t object;
+};
+
+
+auto read_trace(const char* path, uint32_t& threads) -> std::vector<mpa::trace_record_t>
+{
+    std::ifstream file(path, std::ios::binary);
+    std::vector<mpa::trace_record_t> records;
+    mpa::trace_chunk_t chunk;
+
+    while (file.read((char*)&chunk, sizeof(chunk)))
+    {
+        auto first = records.size();
+        records.resize(first + chunk.count);
+        file.read((char*)(records.data() + first), std::streamsize(chunk.count * sizeof(mpa::trace_record_t)));
+        threads = std::max(threads, chunk.thread + 1);
+    }
+
+    std::stable_sort(records.begin(), records.end(), [](auto& a, auto& b) { return a.time < b.time; });
+    return records;
+}
+
+
+// Turns addresses into object indices, so the replay needs no lookups. Frees of objects allocated before
+// the trace started are dropped, objects are numbered from a free list so the table stays small.
+auto to_ops(const std::vector<mpa::trace_record_t>& records, uint32_t& objects, uint64_t& dropped) -> std::vector<replay_op_t>
+{
+    std::vector<replay_op_t> ops;
+    std::unordered_map<uint64_t, uint32_t> live;
+    std::vector<uint32_t> free_objects;
+    ops.reserve(records.size());
+
+    for (auto& record : records)
+    {
+        if (record.op == mpa::trace_op_t::allocate)
+        {
+            auto object = objects;
+            if (free_objects.empty())
+            {
+                ++objects;
+            }
+            else
+            {
+                object = free_objects.back();
+                free_objects.pop_back();
+            }
+
+            live[record.address] = object;
+            ops.push_back({ record.size, record.alignment, record.op, object });
+            continue;
+        }
+
+        auto it = live.find(record.address);
+        if (it == live.end())
+        {
+            ++dropped;
+            continue;
+        }
+
+        ops.push_back({ record.size, record.alignment, record.op, it->second });
+        free_objects.push_back(it->second);
+        live.erase(it);
+    }
+
+    return ops;
+}
+
+
+// Returns the fastest of repetitions runs in nanoseconds. Objects still live at the end are freed untimed.
+auto replay(const std::vector<replay_op_t>& ops, uint32_t objects, uint32_t repetitions, auto make_resource) -> double
+{
+    auto best = 0.0;
+    std::vector<void*> pointers(objects);
+    std::vector<replay_op_t> live(objects);
+
+    for (auto repetition = 0u; repetition < repetitions; ++repetition)
+    {
+        auto resource = make_resource();
+        std::fill(live.begin(), live.end(), replay_op_t{ 0, 0, mpa::trace_op_t::deallocate, 0 });
+
+        auto start = std::chrono::steady_clock::now();
+        for (auto& op : ops)
+        {
+            if (op.op == mpa::trace_op_t::allocate)
+            {
+                pointers[op.object] = resource->allocate(op.size, op.alignment);
+                live[op.object] = op;
+            }
+            else
+            {
+                resource->deallocate(pointers[op.object], op.size, op.alignment);
+                live[op.object].op = mpa::trace_op_t::deallocate;
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        for (auto object = 0u; object < objects; ++object)
+        {
+            if (live[object].op == mpa::trace_op_t::allocate)
+            {
+                resource->deallocate(pointers[object], live[object].size, live[object].alignment);
+            }
+        }
+
+        auto ns = std::chrono::duration<double, std::nano>(end - start).count();
+        best = repetition ? std::min(best, ns) : ns;
+    }
+
+    return best;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <trace file> [repetitions]" << std::endl;
+        return 1;
+    }
+
+    auto repetitions = argc > 2 ? uint32_t(std::max(1, std::atoi(argv[2]))) : 5u;
+    auto threads = uint32_t(0);
+    auto records = read_trace(argv[1], threads);
+    auto objects = uint32_t(0);
+    auto dropped = uint64_t(0);
+    auto ops = to_ops(records, objects, dropped);
+
+    std::map<uint32_t, uint64_t> sizes;
+    for (auto& op : ops)
+    {
+        sizes[op.size] += op.op == mpa::trace_op_t::allocate;
+    }
+
+    std::cout << records.size() << " records of " << threads << " threads, " << dropped << " frees of objects allocated before the trace, "
+        << objects << " objects live at most" << std::endl;
+    std::cout << "allocations by size:";
+    for (auto [size, count] : sizes)
+    {
+        std::cout << " " << size << ":" << count;
+    }
+    std::cout << std::endl << std::endl;
+
+    auto report = [&](const char* name, double ns)
+    {
+        std::cout << std::left << std::setw(44) << name << std::right << std::fixed << std::setprecision(2)
+            << std::setw(10) << ns / 1E6 << " ms" << std::setw(10) << ns / std::max<size_t>(ops.size(), 1) << " ns/op" << std::endl;
+    };
+
+    report("std::pmr::new_delete_resource", replay(ops, objects, repetitions, []()
+    {
+        return std::pmr::new_delete_resource();
+    }));
+    report("std::pmr::unsynchronized_pool_resource", replay(ops, objects, repetitions, []()
+    {
+        return std::make_unique<std::pmr::unsynchronized_pool_resource>();
+    }));
+    report("mpa::pool_resource_t", replay(ops, objects, repetitions, []()
+    {
+        return std::make_unique<mpa::pool_resource_t>();
+    }));
+}
@@ -0,0 +1,128 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+
+// multi_pool_t::deallocate_bulk is reached from noexcept deallocations, so it must not allocate: not for its
+// sort, not for batches longer than its stack buffer and not when it releases the blocks it emptied. Every
+// operator new made while freeing is counted.
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+
+static bool counting = false;
+static size_t allocations = 0;
+
+auto operator new(size_t size) -> void*
+{
+    allocations += counting;
+    if (auto ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator delete(void* ptr) noexcept -> void
+{
+    std::free(ptr);
+}
+
+auto operator delete(void* ptr, size_t) noexcept -> void
+{
+    std::free(ptr);
+}
+
+
+struct object_t
+{
+    uint64_t values[2];
+};
+
+// Blocks of 1024 slots, so the pool holds thousands of blocks and its bit trees more than one level.
+using pool_t = mpa::multi_pool_t<object_t, mpa::heap_block_provider_t, mpa::fixed_geometry_t<uint16_t, 4>>;
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_bulk_free: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+int main()
+{
+    pool_t pool;
+    pool.set_retained_empty_blocks(0);
+
+    // Enough slots for several blocks, freed in shuffled batches longer than the stack buffer.
+    std::vector<object_t*> objects(size_t(1) << 21);
+    pool.allocate_bulk(objects.data(), objects.size());
+    for (auto i = size_t(0); i < objects.size(); ++i)
+    {
+        objects[i]->values[0] = i;
+    }
+    auto blocks = pool.stats().blocks;
+    check(blocks > 64, "objects fit in too few blocks");
+
+    std::mt19937_64 mt(1);
+    std::shuffle(objects.begin(), objects.end(), mt);
+    std::vector<size_t> batches;
+    for (auto freed = size_t(0); freed < objects.size();)
+    {
+        auto batch = std::min(size_t(1 + mt() % 3000), objects.size() - freed);
+        batches.push_back(batch);
+        freed += batch;
+    }
+
+    counting = true;
+    auto freed = size_t(0);
+    for (auto batch : batches)
+    {
+        pool.deallocate_bulk(objects.data() + freed, batch);
+        freed += batch;
+    }
+    counting = false;
+
+    check(allocations == 0, "deallocate_bulk allocated");
+    check(pool.stats().blocks == 0, "emptied blocks were not released");
+
+    // The pool hands out every slot again, each once.
+    pool.allocate_bulk(objects.data(), objects.size());
+    std::sort(objects.begin(), objects.end());
+    check(std::adjacent_find(objects.begin(), objects.end()) == objects.end(), "slot handed out twice");
+    check(pool.stats().blocks == blocks, "slots were lost");
+    pool.deallocate_bulk(objects.data(), objects.size());
+
+    std::cout << "test_bulk_free passed" << std::endl;
+}
@@ -0,0 +1,239 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+
+// allocate(1) of placement_t::lowest_address takes the lowest free slot of the lowest block with free slots,
+// which multi_pool_t finds through a cursor instead of a search. Slots are allocated and freed at random while
+// trim, reset and block releases renumber, decommit and empty the blocks under the cursor. After every
+// allocation all lower blocks must be full, and no slot known to be free in its block may lie below it.
+#include <iostream>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+
+struct object_t
+{
+    uint64_t values[2];
+};
+
+// Blocks of 1024 slots, so the cursor moves between blocks often.
+using pool_t = mpa::multi_pool_t<object_t, mpa::heap_block_provider_t, mpa::fixed_geometry_t<uint16_t, 4>>;
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_cursor: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+// Checks that ptr, just allocated, is the lowest free slot of the lowest block with free slots. freed holds
+// slots known to be free.
+auto check_lowest(const pool_t& pool, const std::set<object_t*>& freed, object_t* ptr) -> void
+{
+    // Blocks with live slots come in block order in both stats and sparse_blocks.
+    auto stats = pool.stats();
+    auto blocks = pool.sparse_blocks(1.0);
+    auto live_block = size_t(0);
+    auto empty_blocks = size_t(0);
+    auto found = false;
+    for (auto occupancy : stats.block_occupancy)
+    {
+        if (occupancy == 0)
+        {
+            ++empty_blocks;
+            continue;
+        }
+
+        auto& block = blocks[live_block++];
+        if (!found && ptr >= block.begin && ptr < block.end)
+        {
+            auto lowest_free = freed.lower_bound((object_t*)block.begin);
+            check(lowest_free == freed.end() || *lowest_free > ptr || *lowest_free >= block.end,
+                  "a lower slot of the block is free");
+            found = true;
+        }
+        check(found || occupancy == 1, "a lower block has free slots");
+    }
+    check(found, "allocated slot is in no live block");
+    // Decommitted blocks are empty and not counted by empty_blocks.
+    check(stats.empty_blocks <= empty_blocks && empty_blocks - stats.empty_blocks == stats.decommitted_blocks,
+          "a decommitted block holds live slots");
+}
+
+
+int main()
+{
+    // The cursor sits on the last block when it empties and is released.
+    {
+        pool_t pool;
+        pool.set_retained_empty_blocks(0);
+        std::set<object_t*> freed;
+        std::vector<object_t*> slots;
+        while (pool.stats().blocks < 2)
+        {
+            slots.push_back(pool.allocate(1));
+        }
+        pool.deallocate(slots.back(), 1);
+        slots.pop_back();
+        check(pool.stats().blocks == 1, "emptied block was not released");
+        slots.push_back(pool.allocate(1));
+        check_lowest(pool, freed, slots.back());
+        for (auto slot : slots)
+        {
+            pool.deallocate(slot, 1);
+        }
+    }
+
+    // The cursor sits on an empty block when trim decommits it.
+    {
+        pool_t pool;
+        std::set<object_t*> freed;
+        auto slot = pool.allocate(1);
+        pool.deallocate(slot, 1);
+        check(pool.trim(0, mpa::trim_t::decommit) == 1 && pool.stats().decommitted_blocks == 1, "empty block was not decommitted");
+        slot = pool.allocate(1);
+        check_lowest(pool, freed, slot);
+        pool.deallocate(slot, 1);
+    }
+
+    pool_t pool;
+    // Start and size of every live run.
+    std::map<object_t*, size_t> live;
+    auto live_slots = size_t(0);
+    // Slots handed out before and free now.
+    std::set<object_t*> freed;
+    std::mt19937_64 mt(1);
+
+    auto free_run = [&](std::map<object_t*, size_t>::iterator it)
+    {
+        for (auto i = size_t(0); i < it->second; ++i)
+        {
+            check(it->first[i].values[0] == uintptr_t(it->first + i), "slot contents changed while it was live");
+            freed.insert(it->first + i);
+        }
+        pool.deallocate(it->first, it->second);
+        live_slots -= it->second;
+        live.erase(it);
+    };
+
+    // Live slots swing towards a target picked anew every 50000 operations, so blocks fill up and drain.
+    auto target = size_t(0);
+    for (auto op = 0; op < 400000; ++op)
+    {
+        if (op % 50000 == 0)
+        {
+            target = size_t(mt() % 40000);
+        }
+
+        // Mostly single slots, some runs and frees, and about once in 2000 operations one that moves the blocks.
+        auto kind = mt() % 2000 ? (live_slots < target) == (mt() % 10 < 8) ? mt() % 530 : 530 + mt() % 460
+                                : 990 + mt() % 10;
+
+        if (kind < 500)
+        {
+            auto ptr = pool.allocate(1);
+            freed.erase(ptr);
+            check_lowest(pool, freed, ptr);
+            check(live.emplace(ptr, 1).second, "slot handed out twice");
+            ptr->values[0] = uintptr_t(ptr);
+            ++live_slots;
+        }
+        else if (kind < 530)
+        {
+            // Runs do not move the cursor, but fill and free its slots.
+            auto n = size_t(2 + mt() % 15);
+            auto ptr = pool.allocate(n);
+            for (auto i = size_t(0); i < n; ++i)
+            {
+                freed.erase(ptr + i);
+                ptr[i].values[0] = uintptr_t(ptr + i);
+            }
+            live.emplace(ptr, n);
+            live_slots += n;
+        }
+        else if (kind < 990)
+        {
+            if (!live.empty())
+            {
+                auto low = uintptr_t(live.begin()->first);
+                auto high = uintptr_t(live.rbegin()->first);
+                auto it = live.lower_bound((object_t*)(low + mt() % (high - low + 1)));
+                free_run(it == live.end() ? live.begin() : it);
+            }
+        }
+        else if (kind < 994)
+        {
+            // Emptied blocks are released as soon as they empty, moving the last block into their entry.
+            pool.set_retained_empty_blocks(mt() % 2);
+        }
+        else if (kind < 997)
+        {
+            pool.trim(mt() % 2, mt() % 2 ? mpa::trim_t::release : mpa::trim_t::decommit);
+        }
+        else if (kind < 999)
+        {
+            // Frees half the slots, so trim finds empty blocks in the middle.
+            for (auto it = live.begin(); it != live.end();)
+            {
+                auto next = std::next(it);
+                if (mt() % 2)
+                {
+                    free_run(it);
+                }
+                it = next;
+            }
+        }
+        else
+        {
+            pool.reset();
+            for (auto& [ptr, n] : live)
+            {
+                for (auto i = size_t(0); i < n; ++i)
+                {
+                    freed.insert(ptr + i);
+                }
+            }
+            live.clear();
+            live_slots = 0;
+        }
+    }
+
+    while (!live.empty())
+    {
+        free_run(live.begin());
+    }
+    pool.trim(0, mpa::trim_t::release);
+    check(pool.stats().blocks == pool.stats().decommitted_blocks, "slots left after everything was freed");
+    std::cout << "test_cursor passed" << std::endl;
+}
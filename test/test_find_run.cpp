@@ -0,0 +1,160 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+// impl::find_run against a plain loop over the candidates, on random pool bitmaps and run lengths. Built once
+// with the default flags and once per instruction set the compiler supports, so every vector version of
+// find_run<u64_t> is compared with the scalar one. Exits with 77 when the host lacks the instruction set.
+#include <iostream>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+
+#include "../multi_pool_alloc.hpp"
+
+
+template <typename T>
+auto scalar_find_run(const T* words, T candidates, uint32_t count) -> uint32_t
+{
+    for (auto word = 0u; word < sizeof(T) * 8; ++word)
+    {
+        if ((candidates >> word & 1) && mpa::impl::run_starts(words[word], count))
+        {
+            return word;
+        }
+    }
+    return sizeof(T) * 8;
+}
+
+
+// Full, empty, sparse and dense words, and words holding a single run, so every run length is found in some
+// words and missed in others.
+template <typename T>
+auto random_word(std::mt19937_64& mt) -> T
+{
+    constexpr auto bits = uint32_t(sizeof(T) * 8);
+    switch (mt() % 6)
+    {
+    case 0:
+        return T(~T(0));
+    case 1:
+        return T(0);
+    case 2:
+        return T(mt() & mt() & mt());
+    case 3:
+        return T(mt() | mt());
+    case 4:
+    {
+        auto length = uint32_t(1 + mt() % bits);
+        auto start = uint32_t(mt() % (bits - length + 1));
+        return T(T(T(~T(0)) >> (bits - length)) << start);
+    }
+    default:
+        return T(mt());
+    }
+}
+
+
+template <typename T>
+auto random_candidates(std::mt19937_64& mt) -> T
+{
+    switch (mt() % 4)
+    {
+    case 0:
+        return T(~T(0));
+    case 1:
+        return T(T(1) << (mt() % (sizeof(T) * 8)));
+    case 2:
+        return T(mt() & mt());
+    default:
+        return T(mt());
+    }
+}
+
+
+template <typename T>
+auto check_find_run(const char* name, uint32_t rounds) -> bool
+{
+    constexpr auto bits = uint32_t(sizeof(T) * 8);
+    std::mt19937_64 mt(bits);
+    T words[bits];
+    for (auto round = 0u; round < rounds; ++round)
+    {
+        for (auto& word : words)
+        {
+            word = random_word<T>(mt);
+        }
+        auto candidates = random_candidates<T>(mt);
+
+        for (auto count = 1u; count <= bits; ++count)
+        {
+            auto expected = scalar_find_run(words, candidates, count);
+            auto found = mpa::impl::find_run(words, candidates, count);
+            if (found != expected)
+            {
+                std::cerr << "test_find_run: " << name << " found word " << found << " instead of " << expected
+                          << " for a run of " << count << " in round " << round << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+
+int main()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #if defined(__AVX512F__)
+    if (!__builtin_cpu_supports("avx512f"))
+    {
+        std::cout << "test_find_run skipped, no AVX-512F" << std::endl;
+        return 77;
+    }
+    #elif defined(__AVX2__)
+    if (!__builtin_cpu_supports("avx2"))
+    {
+        std::cout << "test_find_run skipped, no AVX2" << std::endl;
+        return 77;
+    }
+    #endif
+#endif
+
+#if defined(__AVX512F__)
+    auto version = "AVX-512F";
+#elif defined(__AVX2__)
+    auto version = "AVX2";
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    auto version = "NEON";
+#else
+    auto version = "scalar";
+#endif
+
+    auto passed = check_find_run<uint64_t>("u64", 20000) && check_find_run<uint32_t>("u32", 20000) &&
+                  check_find_run<uint16_t>("u16", 20000) && check_find_run<uint8_t>("u8", 20000);
+    if (!passed)
+    {
+        return 1;
+    }
+    std::cout << "test_find_run passed, " << version << " find_run<u64_t>" << std::endl;
+}
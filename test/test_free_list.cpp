@@ -0,0 +1,213 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// placement_t::free_list hands out the slots freed last first, without touching the bitmaps. Slots on the list
+// count as live in the block occupancy and keep their blocks until the list is flushed, which happens when it
+// is full, by flush and by trim. Runs and types smaller than a pointer bypass the list. test_hardened covers
+// the list with MPA_HARDENED, this test runs without it.
+#if !defined(MPA_FREE_LIST_SIZE)
+    #define MPA_FREE_LIST_SIZE 16
+#endif
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <set>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+static_assert(!MPA_HARDENED, "test_free_list covers the free list without MPA_HARDENED");
+
+
+struct object_t
+{
+    uint64_t values[2];
+};
+
+// Blocks of 1024 slots, so a few thousand objects fill several blocks.
+template <typename T>
+using pool_t = mpa::multi_pool_t<T, mpa::heap_block_provider_t, mpa::fixed_geometry_t<uint16_t, 4>,
+    mpa::placement_t::free_list>;
+
+constexpr size_t list_size = MPA_FREE_LIST_SIZE;
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_free_list: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+template <typename T>
+auto live_slots(const pool_t<T>& pool) -> size_t
+{
+    auto stats = pool.stats();
+    auto live = 0.0;
+    for (auto occupancy : stats.block_occupancy)
+    {
+        live += occupancy * double(stats.block_capacity);
+    }
+    return size_t(live + 0.5);
+}
+
+auto allocate(pool_t<object_t>& pool, size_t count) -> std::vector<object_t*>
+{
+    std::vector<object_t*> objects(count);
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        objects[i] = pool.allocate(1);
+        objects[i]->values[0] = i;
+        objects[i]->values[1] = ~uint64_t(i);
+    }
+    return objects;
+}
+
+
+auto test_lifo() -> void
+{
+    pool_t<object_t> pool;
+    auto objects = allocate(pool, 256);
+
+    // Slots come back in the reverse order they were freed, scattered or not.
+    std::vector<size_t> freed;
+    for (auto i = size_t(0); i < list_size; ++i)
+    {
+        freed.push_back((i * 37) % objects.size());
+        pool.deallocate(objects[freed.back()], 1);
+    }
+    check(live_slots(pool) == objects.size(), "slots on the free list not counted as live");
+    for (auto i = freed.size(); i-- > 0;)
+    {
+        auto ptr = pool.allocate(1);
+        check(ptr == objects[freed[i]], "free list not handed out last in, first out");
+        *ptr = { freed[i], ~uint64_t(freed[i]) };
+    }
+    check(live_slots(pool) == objects.size(), "slots from the free list counted twice");
+
+    std::set<object_t*> seen(objects.begin(), objects.end());
+    auto more = allocate(pool, 64);
+    for (auto ptr : more)
+    {
+        check(seen.insert(ptr).second, "slot handed out twice");
+    }
+    for (auto i = size_t(0); i < objects.size(); ++i)
+    {
+        check(objects[i]->values[0] == i && objects[i]->values[1] == ~uint64_t(i), "live object overwritten");
+    }
+}
+
+auto test_flush() -> void
+{
+    pool_t<object_t> pool;
+    auto objects = allocate(pool, 256);
+
+    // A full list is flushed by the next free, which then starts the list again.
+    for (auto i = size_t(0); i < list_size; ++i)
+    {
+        pool.deallocate(objects[i], 1);
+    }
+    check(live_slots(pool) == objects.size(), "free list flushed before it was full");
+    pool.deallocate(objects[list_size], 1);
+    check(live_slots(pool) == objects.size() - list_size, "full free list not flushed");
+    check(pool.allocate(1) == objects[list_size], "free list not started again after a flush");
+
+    // Flushed slots are allocated again lowest address first.
+    pool.deallocate(objects[list_size + 1], 1);
+    pool.flush();
+    check(live_slots(pool) == objects.size() - list_size - 1, "flush left slots on the free list");
+    check(pool.allocate(1) == objects[0], "flushed slots not allocated lowest address first");
+
+    // Runs are not put on the list.
+    auto run = pool.allocate(4);
+    auto live = live_slots(pool);
+    pool.deallocate(run, 4);
+    check(live_slots(pool) == live - 4, "run put on the free list");
+}
+
+auto test_release() -> void
+{
+    pool_t<object_t> pool;
+    pool.set_retained_empty_blocks(0);
+    auto capacity = pool.stats().block_capacity;
+    auto objects = allocate(pool, 3 * capacity);
+
+    // The last slots of block 1 wait on the list and keep it until trim flushes them.
+    for (auto i = capacity; i < 2 * capacity; ++i)
+    {
+        pool.deallocate(objects[i], 1);
+    }
+    check(pool.stats().blocks == 3, "block released while its slots were on the free list");
+    check(pool.trim() == 0 && pool.stats().blocks == 2, "trim did not flush the free list");
+
+    // Same for block 2 with flush, which releases it as soon as it is empty.
+    for (auto i = 2 * capacity; i < 3 * capacity; ++i)
+    {
+        pool.deallocate(objects[i], 1);
+    }
+    check(pool.stats().blocks == 2, "block released while its slots were on the free list");
+    pool.flush();
+    check(pool.stats().blocks == 1, "flush did not release the emptied block");
+
+    // reset drops the list with everything else.
+    for (auto i = size_t(0); i < list_size / 2; ++i)
+    {
+        pool.deallocate(objects[i], 1);
+    }
+    pool.reset();
+    std::set<object_t*> seen;
+    for (auto i = size_t(0); i < capacity; ++i)
+    {
+        check(seen.insert(pool.allocate(1)).second, "slot on the free list handed out again after reset");
+    }
+    check(pool.stats().blocks == 1, "blocks allocated while the reset block had room");
+}
+
+auto test_small() -> void
+{
+    // A uint32_t cannot hold the link, so the pool places like lowest_address.
+    pool_t<uint32_t> pool;
+    std::vector<uint32_t*> objects(64);
+    for (auto& ptr : objects)
+    {
+        ptr = pool.allocate(1);
+    }
+    pool.deallocate(objects[10], 1);
+    pool.deallocate(objects[20], 1);
+    check(live_slots(pool) == objects.size() - 2, "small slots put on a free list");
+    check(pool.allocate(1) == objects[10], "small slots not allocated lowest address first");
+}
+
+
+int main()
+{
+    test_lifo();
+    test_flush();
+    test_release();
+    test_small();
+
+    std::cout << "test_free_list passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,154 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+// Every misuse the MPA_HARDENED checks catch is made in a forked child, which must abort with the message of
+// that check on stderr. A child using the pool correctly must exit normally.
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <csignal>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../multi_pool_alloc.hpp"
+
+static_assert(MPA_HARDENED, "test_hardened must be built with MPA_HARDENED=1");
+
+
+struct object_t
+{
+    uint64_t values[2];
+};
+
+using pool_t = mpa::multi_pool_t<object_t>;
+using free_list_pool_t = mpa::multi_pool_t<object_t, mpa::heap_block_provider_t, mpa::adaptive_geometry_t<>, mpa::placement_t::free_list>;
+
+
+// Runs function in a child process with stderr going to a pipe. Returns whether the child aborted, or exited
+// normally when message is null, and whether its stderr holds message.
+template <typename Function>
+auto run(const char* name, const char* message, Function function) -> bool
+{
+    int output[2];
+    if (pipe(output) != 0)
+    {
+        std::cerr << "test_hardened: cannot create a pipe" << std::endl;
+        return false;
+    }
+
+    auto pid = fork();
+    if (pid == 0)
+    {
+        close(output[0]);
+        dup2(output[1], STDERR_FILENO);
+        function();
+        _exit(0);
+    }
+    close(output[1]);
+
+    auto written = std::string();
+    char buffer[256];
+    for (auto bytes = read(output[0], buffer, sizeof(buffer)); bytes > 0; bytes = read(output[0], buffer, sizeof(buffer)))
+    {
+        written.append(buffer, size_t(bytes));
+    }
+    close(output[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    auto passed = message ? WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT && written.find(message) != std::string::npos
+                          : WIFEXITED(status) && WEXITSTATUS(status) == 0 && written.empty();
+    if (!passed)
+    {
+        std::cerr << "test_hardened: " << name << " failed, stderr: " << written << std::endl;
+    }
+    return passed;
+}
+
+
+int main()
+{
+    auto passed = true;
+
+    passed &= run("correct use", nullptr, []()
+    {
+        pool_t pool;
+        auto slot = pool.allocate(1);
+        auto run = pool.allocate(pool_t::max_contiguous);
+        pool.deallocate(slot, 1);
+        pool.deallocate(run, pool_t::max_contiguous);
+    });
+
+    passed &= run("double free", "mpa: double free", []()
+    {
+        pool_t pool;
+        auto slot = pool.allocate(1);
+        pool.allocate(1);
+        pool.deallocate(slot, 1);
+        pool.deallocate(slot, 1);
+    });
+
+    passed &= run("foreign pointer", "mpa: deallocated pointer does not belong to this pool", []()
+    {
+        pool_t pool;
+        pool_t other;
+        pool.allocate(1);
+        other.deallocate(other.allocate(1), 1);
+        other.deallocate(pool.allocate(1), 1);
+    });
+
+    passed &= run("misaligned pointer", "mpa: deallocated pointer does not start a slot", []()
+    {
+        pool_t pool;
+        auto slot = pool.allocate(1);
+        pool.deallocate((object_t*)((char*)slot + 8), 1);
+    });
+
+    // A run of max_contiguous starts a pool word, one slot further it ends in the next word.
+    passed &= run("run crossing a word", "mpa: deallocated run does not fit in a pool word", []()
+    {
+        pool_t pool;
+        auto run = pool.allocate(pool_t::max_contiguous);
+        pool.allocate(pool_t::max_contiguous);
+        pool.deallocate(run + 1, pool_t::max_contiguous);
+    });
+
+    // The freed slot sits in the free list, its bitmap still marks it allocated.
+    passed &= run("free list duplicate", "mpa: double free", []()
+    {
+        free_list_pool_t pool;
+        auto first = pool.allocate(1);
+        auto second = pool.allocate(1);
+        pool.deallocate(first, 1);
+        pool.deallocate(second, 1);
+        pool.deallocate(first, 1);
+    });
+
+    if (!passed)
+    {
+        return 1;
+    }
+    std::cout << "test_hardened passed" << std::endl;
+}
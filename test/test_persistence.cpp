@@ -0,0 +1,209 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+// A std::map kept in a mapped_file_t is built by one process and found again, checked and changed by
+// later ones. Every run is a forked child, so each maps the file into an address space of its own.
+#include <iostream>
+#include <random>
+#include <cstdint>
+#include <map>
+#include <new>
+
+#include <sys/wait.h>
+
+#include "../multi_pool_alloc.hpp"
+
+
+// Outside the ranges the sanitizers reserve on x86-64 and AArch64.
+static void* const base = (void*)0x500000000000;
+static constexpr size_t capacity = size_t(1) << 30;
+static constexpr uint64_t key_count = uint64_t(1) << 17;
+
+using resource_t = mpa::basic_pool_resource_t<mpa::mapped_file_block_provider_t>;
+using map_t = std::map<uint64_t, uint64_t, std::less<uint64_t>, mpa::pool_allocator_t<std::pair<const uint64_t, uint64_t>, true, resource_t>>;
+
+struct root_t
+{
+    resource_t resource;
+    map_t map;
+};
+
+static_assert(sizeof(root_t) <= mpa::mapped_file_t::root_size);
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_persistence: " << what << std::endl;
+        _exit(1);
+    }
+}
+
+
+// Runs function in a child process and returns whether it exited with 0.
+template <typename Function>
+auto run(Function function) -> bool
+{
+    auto pid = fork();
+    if (pid == 0)
+    {
+        function();
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+// Maps the file and takes over the resource left in root(). The map needs no constructor, its nodes and
+// its allocator all live in the file.
+template <typename Function>
+auto with_root(const char* path, Function function) -> void
+{
+    mpa::mapped_file_t file(path, base, capacity);
+    auto root = (root_t*)file.root();
+    new (&root->resource) resource_t(mpa::mapped_file_block_provider_t(file));
+    if (!file.restored())
+    {
+        new (&root->map) map_t(&root->resource);
+    }
+
+    function(file, *root);
+    file.sync();
+}
+
+
+auto value_of(uint64_t key, uint64_t generation) -> uint64_t
+{
+    return key * 0x9e3779b97f4a7c15 + generation;
+}
+
+
+int main()
+{
+    auto path = "test_persistence.mpa";
+    unlink(path);
+
+    auto built = run([&]()
+    {
+        with_root(path, [](mpa::mapped_file_t& file, root_t& root)
+        {
+            check(!file.restored(), "new file reported as restored");
+            for (auto key = uint64_t(0); key < key_count; ++key)
+            {
+                root.map.emplace(key, value_of(key, 0));
+            }
+        });
+    });
+    check(built, "building the map failed");
+
+    // Odd keys are replaced, so the adopted pools must hand out slots next to live nodes without reusing them.
+    auto changed = run([&]()
+    {
+        with_root(path, [](mpa::mapped_file_t& file, root_t& root)
+        {
+            check(file.restored(), "existing file not restored");
+            check(root.map.size() == key_count, "restored map has the wrong size");
+            auto key = uint64_t(0);
+            for (auto& [k, v] : root.map)
+            {
+                check(k == key && v == value_of(key, 0), "restored map has the wrong contents");
+                ++key;
+            }
+
+            for (auto key = uint64_t(1); key < key_count; key += 2)
+            {
+                root.map.erase(key);
+            }
+            for (auto key = key_count; key < 2 * key_count; ++key)
+            {
+                root.map.emplace(key, value_of(key, 1));
+            }
+        });
+    });
+    check(changed, "changing the restored map failed");
+
+    auto checked = run([&]()
+    {
+        with_root(path, [](mpa::mapped_file_t& file, root_t& root)
+        {
+            check(root.map.size() == key_count / 2 + key_count, "changed map has the wrong size");
+            for (auto key = uint64_t(0); key < 2 * key_count; ++key)
+            {
+                auto it = root.map.find(key);
+                if (key < key_count && key % 2)
+                {
+                    check(it == root.map.end(), "erased key found");
+                }
+                else
+                {
+                    check(it != root.map.end() && it->second == value_of(key, key >= key_count), "changed map has the wrong contents");
+                }
+            }
+
+            // Clearing the map gives back every node, so all blocks are empty again.
+            root.map.clear();
+            root.resource.trim();
+            auto blocks = size_t(0);
+            file.for_each_block([&](void*, size_t) { ++blocks; });
+            check(blocks == 0, "blocks left after the map was cleared");
+        });
+    });
+    check(checked, "checking the changed map failed");
+    unlink(path);
+
+    // A file whose first run died before setting it up is set up again instead of being rejected.
+    auto fd = open(path, O_RDWR | O_CREAT, 0644);
+    check(fd >= 0 && ftruncate(fd, off_t(capacity)) == 0, "cannot create a zero filled file");
+    close(fd);
+    check(run([&]() { mpa::mapped_file_t file(path, base, capacity); check(!file.restored(), "zero filled file restored"); }),
+        "zero filled file rejected");
+    unlink(path);
+
+    // A file created by a run that cannot map it is left empty, so the next run creates it again.
+    auto failed = run([&]()
+    {
+        check(mmap(base, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == base, "cannot occupy the base address");
+        try
+        {
+            mpa::mapped_file_t file(path, base, capacity);
+        }
+        catch (const std::system_error&)
+        {
+            struct stat file_stat;
+            check(stat(path, &file_stat) == 0 && file_stat.st_size == 0, "file left behind by a failed mapping");
+            return;
+        }
+        check(false, "mapping over an occupied base address succeeded");
+    });
+    check(failed, "failed mapping not handled");
+    check(run([&]() { mpa::mapped_file_t file(path, base, capacity); check(!file.restored(), "emptied file restored"); }),
+        "file emptied after a failed mapping rejected");
+    unlink(path);
+
+    std::cout << "test_persistence passed" << std::endl;
+}
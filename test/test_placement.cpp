@@ -0,0 +1,179 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// placement_t::fullest_block puts new objects into the fullest block with free slots, so sparse blocks get
+// none while fuller ones have room and drain under churn until they can be released. sparse_blocks and
+// occupancy_of must report the blocks and their live slots exactly.
+#include <iostream>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+
+struct object_t
+{
+    uint64_t values[2];
+};
+
+// Blocks of 1024 slots, so a few thousand objects fill several blocks.
+using pool_t = mpa::multi_pool_t<object_t, mpa::heap_block_provider_t, mpa::fixed_geometry_t<uint16_t, 4>,
+    mpa::placement_t::fullest_block>;
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_placement: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+// Index of the block of blocks holding ptr.
+auto block_of(const std::vector<mpa::block_info_t>& blocks, const object_t* ptr) -> size_t
+{
+    for (auto i = size_t(0); i < blocks.size(); ++i)
+    {
+        if (ptr >= blocks[i].begin && ptr < blocks[i].end)
+        {
+            return i;
+        }
+    }
+    check(false, "object outside every block");
+    return 0;
+}
+
+// Allocates count objects into live and checks that all of them land in block.
+auto allocate_into(pool_t& pool, const std::vector<mpa::block_info_t>& blocks,
+    std::vector<std::vector<object_t*>>& live, size_t count, size_t block) -> void
+{
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        auto ptr = pool.allocate(1);
+        check(block_of(blocks, ptr) == block, "object not placed in the fullest block");
+        live[block].push_back(ptr);
+    }
+}
+
+auto free_from(pool_t& pool, std::vector<object_t*>& live, size_t count) -> void
+{
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        pool.deallocate(live.back(), 1);
+        live.pop_back();
+    }
+}
+
+auto check_reports(const pool_t& pool, const std::vector<std::vector<object_t*>>& live, size_t capacity) -> void
+{
+    auto sparse = pool.sparse_blocks(0.5);
+    auto all = pool.sparse_blocks(1.0);
+    auto expected = size_t(0);
+    for (auto i = size_t(0); i < live.size(); ++i)
+    {
+        auto occupancy = double(live[i].size()) / double(capacity);
+        check(all[i].live_slots == live[i].size() && all[i].occupancy == occupancy, "sparse_blocks miscounted");
+        check(pool.occupancy_of(live[i].front()) == occupancy, "occupancy_of miscounted");
+        if (occupancy <= 0.5)
+        {
+            check(expected < sparse.size() && sparse[expected].begin == all[i].begin, "sparse block not reported");
+            ++expected;
+        }
+    }
+    check(sparse.size() == expected, "block reported as sparse that is not");
+}
+
+
+int main()
+{
+    pool_t pool;
+    pool.set_retained_empty_blocks(0);
+    auto capacity = pool.stats().block_capacity;
+
+    std::vector<std::vector<object_t*>> live(4);
+    for (auto i = size_t(0); i < 4 * capacity; ++i)
+    {
+        auto ptr = pool.allocate(1);
+        live[i / capacity].push_back(ptr);
+    }
+    auto blocks = pool.sparse_blocks(1.0);
+    check(blocks.size() == 4, "objects fill the wrong number of blocks");
+    for (auto i = size_t(0); i < 4; ++i)
+    {
+        for (auto ptr : live[i])
+        {
+            check(block_of(blocks, ptr) == i, "blocks not filled in order");
+        }
+    }
+
+    // Block 0 ends up sparse, block 1 half full, block 2 nearly full and block 3 full.
+    auto freed = std::vector<size_t>{ capacity - capacity / 8, capacity / 2, capacity / 10, 0 };
+    for (auto i = size_t(0); i < 4; ++i)
+    {
+        free_from(pool, live[i], freed[i]);
+    }
+    check_reports(pool, live, capacity);
+
+    // The fullest block is filled first, then the next fullest. The lowest block, which lowest_address would
+    // use, comes last.
+    allocate_into(pool, blocks, live, freed[2], 2);
+    allocate_into(pool, blocks, live, freed[1], 1);
+    allocate_into(pool, blocks, live, freed[0], 0);
+    check(pool.stats().blocks == 4, "a block was allocated while blocks had room");
+    check(pool.sparse_blocks(0.99).empty(), "blocks left with room");
+
+    // Under churn in the fuller blocks the sparse block gets no new objects and drains.
+    free_from(pool, live[0], freed[0]);
+    free_from(pool, live[1], capacity / 8);
+    free_from(pool, live[2], capacity / 8);
+    free_from(pool, live[3], capacity / 8);
+    check_reports(pool, live, capacity);
+    std::mt19937_64 mt(1);
+    while (!live[0].empty())
+    {
+        for (auto i = 0; i < 16; ++i)
+        {
+            auto& from = live[1 + mt() % 3];
+            auto slot = mt() % from.size();
+            pool.deallocate(from[slot], 1);
+            from[slot] = from.back();
+            from.pop_back();
+
+            auto ptr = pool.allocate(1);
+            auto block = block_of(blocks, ptr);
+            check(block != 0, "sparse block got a new object while fuller blocks had room");
+            live[block].push_back(ptr);
+        }
+        check_reports(pool, live, capacity);
+        free_from(pool, live[0], 1);
+    }
+
+    auto stats = pool.stats();
+    check(stats.blocks == 3 && stats.empty_blocks == 0, "drained block not released");
+
+    std::cout << "test_placement passed" << std::endl;
+    return 0;
+}
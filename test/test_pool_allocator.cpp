@@ -0,0 +1,221 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// pool_allocator_t allocators compare equal exactly when they use the same resource, and rebound copies use
+// the resource of the original. With Propagate the resource follows the contents on container copy and move
+// assignment and swap, without it every container stays on its resource. Each resource counts the bytes it
+// has live, so the test sees which resource every container allocates from and frees to.
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+
+struct counting_resource_t : mpa::pool_resource_t
+{
+    size_t live_bytes = 0;
+
+    template <typename T>
+    auto allocate_object(size_t n = 1) -> T*
+    {
+        live_bytes += n * sizeof(T);
+        return mpa::pool_resource_t::allocate_object<T>(n);
+    }
+
+    template <typename T>
+    auto deallocate_object(T* ptr, size_t n = 1) -> void
+    {
+        live_bytes -= n * sizeof(T);
+        mpa::pool_resource_t::deallocate_object(ptr, n);
+    }
+};
+
+template <typename T, bool Propagate>
+using allocator_t = mpa::pool_allocator_t<T, Propagate, counting_resource_t>;
+template <bool Propagate>
+using vector_t = std::vector<uint64_t, allocator_t<uint64_t, Propagate>>;
+template <bool Propagate>
+using map_t = std::map<uint64_t, uint64_t, std::less<uint64_t>,
+    allocator_t<std::pair<const uint64_t, uint64_t>, Propagate>>;
+
+static_assert(std::allocator_traits<allocator_t<int, true>>::propagate_on_container_copy_assignment::value);
+static_assert(std::allocator_traits<allocator_t<int, true>>::propagate_on_container_move_assignment::value);
+static_assert(std::allocator_traits<allocator_t<int, true>>::propagate_on_container_swap::value);
+static_assert(!std::allocator_traits<allocator_t<int, false>>::propagate_on_container_copy_assignment::value);
+static_assert(!std::allocator_traits<allocator_t<int, false>>::propagate_on_container_move_assignment::value);
+static_assert(!std::allocator_traits<allocator_t<int, false>>::propagate_on_container_swap::value);
+static_assert(!std::allocator_traits<allocator_t<int, true>>::is_always_equal::value);
+static_assert(std::is_same_v<std::allocator_traits<allocator_t<int, false>>::rebind_alloc<double>,
+    allocator_t<double, false>>);
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_pool_allocator: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+template <bool Propagate>
+auto make_vector(counting_resource_t& resource, uint64_t first, size_t count) -> vector_t<Propagate>
+{
+    vector_t<Propagate> values(&resource);
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        values.push_back(first + i);
+    }
+    return values;
+}
+
+template <typename Container>
+auto check_values(const Container& values, uint64_t first, size_t count) -> void
+{
+    check(values.size() == count, "container lost elements");
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        check(values[i] == first + i, "container elements changed");
+    }
+}
+
+
+auto test_equality() -> void
+{
+    counting_resource_t a;
+    counting_resource_t b;
+    allocator_t<uint64_t, true> on_a(&a);
+    allocator_t<double, true> rebound(on_a);
+    allocator_t<uint64_t, true> back(rebound);
+
+    check(on_a == allocator_t<uint64_t, true>(&a), "allocators of the same resource compare unequal");
+    check(on_a == rebound && rebound == on_a && back == on_a, "rebound allocator compares unequal");
+    check(rebound.resource() == &a, "rebound allocator uses another resource");
+    check(on_a != allocator_t<uint64_t, true>(&b), "allocators of different resources compare equal");
+
+    // Memory from one allocator is freed by another equal one, of any type.
+    auto ptr = rebound.allocate(3);
+    check(a.live_bytes == 3 * sizeof(double) && b.live_bytes == 0, "rebound allocator used another resource");
+    allocator_t<double, true>(back).deallocate(ptr, 3);
+    check(a.live_bytes == 0, "equal allocator did not free to the resource");
+
+    // Node containers allocate their rebound node types from the resource.
+    {
+        map_t<true> map(&a);
+        for (auto i = uint64_t(0); i < 100; ++i)
+        {
+            map[i] = i;
+        }
+        std::list<uint64_t, allocator_t<uint64_t, true>> list(100, 1, &b);
+        check(a.live_bytes >= 100 * sizeof(std::pair<const uint64_t, uint64_t>), "map nodes not from the resource");
+        check(b.live_bytes >= 100 * sizeof(uint64_t), "list nodes not from the resource");
+    }
+    check(a.live_bytes == 0 && b.live_bytes == 0, "nodes not freed to their resource");
+}
+
+auto test_propagate() -> void
+{
+    counting_resource_t a;
+    counting_resource_t b;
+
+    {
+        // Moves take the buffer and its resource along.
+        auto to = make_vector<true>(a, 0, 100);
+        auto from = make_vector<true>(b, 1000, 200);
+        auto data = from.data();
+        auto a_bytes = a.live_bytes;
+        to = std::move(from);
+        check(to.get_allocator().resource() == &b && to.data() == data, "move assignment did not take the buffer");
+        check_values(to, 1000, 200);
+        check(a.live_bytes < a_bytes, "move assignment kept the old buffer");
+
+        // Copies take the resource of the source.
+        auto copy = make_vector<true>(a, 0, 10);
+        copy = to;
+        check(copy.get_allocator().resource() == &b, "copy assignment did not take the resource");
+        check_values(copy, 1000, 200);
+
+        // Swaps exchange the resources with the buffers.
+        auto other = make_vector<true>(a, 5000, 50);
+        auto other_data = other.data();
+        std::swap(other, copy);
+        check(copy.get_allocator().resource() == &a && copy.data() == other_data, "swap did not exchange resources");
+        check(other.get_allocator().resource() == &b, "swap did not exchange resources");
+        check_values(copy, 5000, 50);
+        check_values(other, 1000, 200);
+    }
+    check(a.live_bytes == 0 && b.live_bytes == 0, "memory freed to the wrong resource");
+}
+
+auto test_no_propagate() -> void
+{
+    counting_resource_t a;
+    counting_resource_t b;
+
+    {
+        // Moves between resources copy the elements and leave both containers on their resource.
+        auto to = make_vector<false>(a, 0, 100);
+        auto from = make_vector<false>(b, 1000, 200);
+        auto data = from.data();
+        to = std::move(from);
+        check(to.get_allocator().resource() == &a && to.data() != data, "move assignment took the resource");
+        check_values(to, 1000, 200);
+        check(a.live_bytes >= 200 * sizeof(uint64_t), "moved elements not on the resource of the target");
+
+        // Moves on the same resource still take the buffer.
+        auto same = make_vector<false>(a, 7000, 30);
+        data = same.data();
+        to = std::move(same);
+        check(to.data() == data, "move assignment on one resource copied the elements");
+        check_values(to, 7000, 30);
+
+        auto copy = make_vector<false>(b, 0, 10);
+        copy = to;
+        check(copy.get_allocator().resource() == &b, "copy assignment took the resource");
+        check_values(copy, 7000, 30);
+
+        // A copy constructed container uses the resource of its source, as no select_on_container_copy_construction
+        // says otherwise.
+        auto constructed(copy);
+        check(constructed.get_allocator().resource() == &b, "copy construction changed the resource");
+    }
+    check(a.live_bytes == 0 && b.live_bytes == 0, "memory freed to the wrong resource");
+}
+
+
+int main()
+{
+    test_equality();
+    test_propagate();
+    test_no_propagate();
+
+    std::cout << "test_pool_allocator passed" << std::endl;
+    return 0;
+}
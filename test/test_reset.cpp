@@ -0,0 +1,206 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// reset frees every slot of a pool at once. The blocks are kept, every slot is handed out again exactly once,
+// lowest address first, and remote frees queued before the reset are dropped instead of freeing slots twice.
+// Counters need MPA_STATS, which is enabled here.
+#if !defined(MPA_STATS)
+    #define MPA_STATS 1
+#endif
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+
+struct object_t
+{
+    uint64_t values[2];
+};
+
+// Blocks of 1024 slots, so a few thousand objects fill several blocks.
+using pool_t = mpa::multi_pool_t<object_t, mpa::heap_block_provider_t, mpa::fixed_geometry_t<uint16_t, 4>>;
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_reset: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+// Allocates count objects and checks that no slot is handed out twice.
+auto allocate_distinct(pool_t& pool, size_t count) -> std::vector<object_t*>
+{
+    std::vector<object_t*> objects(count);
+    std::set<object_t*> seen;
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        objects[i] = pool.allocate(1);
+        objects[i]->values[0] = i;
+        check(seen.insert(objects[i]).second, "slot handed out twice");
+    }
+    for (auto i = size_t(0); i < count; ++i)
+    {
+        check(objects[i]->values[0] == i, "object overwritten");
+    }
+    return objects;
+}
+
+auto check_reset(const pool_t& pool, size_t blocks) -> void
+{
+    auto stats = pool.stats();
+    check(stats.blocks == blocks, "reset changed the number of blocks");
+    check(stats.empty_blocks == blocks - stats.decommitted_blocks, "reset left blocks that are not empty");
+    for (auto occupancy : stats.block_occupancy)
+    {
+        check(occupancy == 0.0, "reset left live slots");
+    }
+    check(stats.counters.deallocations == stats.counters.allocations, "reset not counted as deallocations");
+    check(stats.counters.live_slots == 0, "reset left live slots counted");
+    check(pool.sparse_blocks(1.0).empty(), "sparse_blocks reports blocks after reset");
+}
+
+
+auto test_reuse() -> void
+{
+    pool_t pool;
+    auto capacity = pool.stats().block_capacity;
+    auto objects = allocate_distinct(pool, 4 * capacity + capacity / 2);
+    auto blocks = pool.stats().blocks;
+    check(blocks == 5, "objects fill the wrong number of blocks");
+
+    // Some slots are freed before the reset, one block is fully free and another emptied and retained.
+    for (auto i = size_t(0); i < capacity; i += 3)
+    {
+        pool.deallocate(objects[i], 1);
+    }
+    for (auto i = 2 * capacity; i < 3 * capacity; ++i)
+    {
+        pool.deallocate(objects[i], 1);
+    }
+    auto first = objects[0];
+
+    pool.reset();
+    check_reset(pool, blocks);
+
+    // Every block is filled again before a new one is allocated, starting at the lowest address.
+    objects = allocate_distinct(pool, blocks * capacity);
+    check(objects[0] == first, "reset pool does not start at the lowest slot");
+    check(pool.stats().blocks == blocks, "blocks not reused after reset");
+    check(pool.stats().counters.live_slots == blocks * capacity, "live slots miscounted after reset");
+
+    pool.reset();
+    check(pool.trim() == blocks, "trim did not release the blocks kept by reset");
+    check(pool.stats().blocks == 0, "trim left blocks after reset");
+}
+
+auto test_decommitted() -> void
+{
+    pool_t pool;
+    pool.set_retained_empty_blocks(8);
+    auto capacity = pool.stats().block_capacity;
+    auto objects = allocate_distinct(pool, 3 * capacity);
+    for (auto i = capacity; i < 3 * capacity; ++i)
+    {
+        pool.deallocate(objects[i], 1);
+    }
+    check(pool.trim(0, mpa::trim_t::decommit) == 2, "blocks not decommitted");
+
+    // Decommitted blocks stay decommitted and are not counted as empty.
+    pool.reset();
+    check_reset(pool, 3);
+    check(pool.stats().decommitted_blocks == 2, "reset changed the decommitted blocks");
+    allocate_distinct(pool, 3 * capacity);
+    check(pool.stats().blocks == 3, "blocks not reused after reset");
+}
+
+auto test_remote() -> void
+{
+    pool_t pool;
+    auto capacity = pool.stats().block_capacity;
+    auto objects = allocate_distinct(pool, 2 * capacity);
+
+    // Frees queued by another thread belong to slots reset frees as well, collecting them later would free
+    // slots handed out again.
+    std::thread([&]
+    {
+        for (auto i = size_t(0); i < objects.size(); i += 2)
+        {
+            pool_t::deallocate_remote(objects[i], 1);
+        }
+    }).join();
+
+    pool.reset();
+    check_reset(pool, 2);
+    objects = allocate_distinct(pool, 2 * capacity);
+    pool.collect_remote();
+    auto stats = pool.stats();
+    check(stats.blocks == 2, "blocks not reused after reset");
+    check(stats.block_occupancy[0] == 1.0 && stats.block_occupancy[1] == 1.0,
+        "remote frees queued before reset freed slots");
+
+    // Remote frees made after the reset are queued and collected again.
+    std::thread([&] { pool_t::deallocate_remote(objects[0], 1); }).join();
+    pool.collect_remote();
+    stats = pool.stats();
+    check(stats.block_occupancy[0] * double(capacity) == double(capacity - 1) && stats.block_occupancy[1] == 1.0,
+        "remote free after reset not collected");
+}
+
+auto test_resource() -> void
+{
+    mpa::pool_resource_t resource;
+    std::vector<void*> ptrs(4096);
+    for (auto& ptr : ptrs)
+    {
+        ptr = resource.allocate(48, 16);
+    }
+    resource.reset();
+
+    std::set<void*> seen(ptrs.begin(), ptrs.end());
+    for (auto i = size_t(0); i < ptrs.size(); ++i)
+    {
+        check(seen.count(resource.allocate(48, 16)), "pool_resource_t::reset did not reuse its slots");
+    }
+    resource.reset();
+    check(resource.trim() > 0, "pool_resource_t::reset released its blocks");
+}
+
+
+int main()
+{
+    test_reuse();
+    test_decommitted();
+    test_remote();
+    test_resource();
+
+    std::cout << "test_reset passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,142 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+
+// Random allocate(n) and deallocate(p, n) with n from 1 to past max_contiguous, checked against a shadow map of
+// the live runs: no run may overlap another, and every run keeps the bytes written into it until it is freed.
+#include <iostream>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+
+struct object_t
+{
+    uint64_t values[3];
+};
+
+
+auto check(bool condition, const char* name, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_runs: " << name << ": " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+auto value_of(uint64_t seed, size_t i) -> uint64_t
+{
+    return (seed + i) * 0x9e3779b97f4a7c15;
+}
+
+
+template <typename Pool>
+auto run(const char* name) -> void
+{
+    struct live_t
+    {
+        size_t n;
+        uint64_t seed;
+    };
+
+    Pool pool;
+    std::map<const object_t*, live_t> live;
+    std::mt19937_64 mt(1);
+
+    auto free_run = [&](std::map<const object_t*, live_t>::iterator it)
+    {
+        auto ptr = (object_t*)it->first;
+        for (auto i = size_t(0); i < it->second.n; ++i)
+        {
+            check(ptr[i].values[0] == value_of(it->second.seed, i) && ptr[i].values[2] == ~ptr[i].values[0], name,
+                  "run contents changed while it was live");
+        }
+        pool.deallocate(ptr, it->second.n);
+        live.erase(it);
+    };
+
+    for (auto op = 0; op < 200000; ++op)
+    {
+        // Mostly short runs, some as long as max_contiguous and a few longer, which come from operator new.
+        auto kind = mt() % 16;
+        auto n = kind < 8 ? size_t(1 + mt() % 4) : kind < 15 ? size_t(1 + mt() % Pool::max_contiguous)
+                                                             : size_t(Pool::max_contiguous + 1 + mt() % 64);
+
+        if (live.size() > 2000 || (!live.empty() && mt() % 2))
+        {
+            // Some live run near a random address between the lowest and the highest one.
+            auto low = uintptr_t(live.begin()->first);
+            auto high = uintptr_t(live.rbegin()->first);
+            auto it = live.lower_bound((const object_t*)(low + mt() % (high - low + 1)));
+            free_run(it == live.end() ? live.begin() : it);
+            continue;
+        }
+
+        auto ptr = pool.allocate(n);
+        check(ptr, name, "allocation failed");
+        auto next = live.lower_bound(ptr);
+        check(next == live.end() || ptr + n <= next->first, name, "run overlaps the next live run");
+        if (next != live.begin())
+        {
+            auto previous = std::prev(next);
+            check(previous->first + previous->second.n <= ptr, name, "run overlaps the previous live run");
+        }
+
+        auto seed = mt();
+        for (auto i = size_t(0); i < n; ++i)
+        {
+            ptr[i].values[0] = value_of(seed, i);
+            ptr[i].values[2] = ~ptr[i].values[0];
+        }
+        live.emplace(ptr, live_t{ n, seed });
+    }
+
+    while (!live.empty())
+    {
+        free_run(live.begin());
+    }
+
+    // Trimming flushes the free list, after that every block is empty and released.
+    pool.trim(0, mpa::trim_t::release);
+    check(pool.stats().blocks == 0, name, "slots still live after every run was freed");
+    std::cout << name << " passed" << std::endl;
+}
+
+
+int main()
+{
+    using namespace mpa;
+    run<multi_pool_t<object_t>>("lowest_address");
+    run<multi_pool_t<object_t, heap_block_provider_t, adaptive_geometry_t<>, placement_t::recently_freed>>("recently_freed");
+    run<multi_pool_t<object_t, heap_block_provider_t, adaptive_geometry_t<>, placement_t::fullest_block>>("fullest_block");
+    run<multi_pool_t<object_t, heap_block_provider_t, adaptive_geometry_t<>, placement_t::free_list>>("free_list");
+    // Words of 16 slots and blocks of 1024, so runs fill words and blocks quickly.
+    run<multi_pool_t<object_t, page_block_provider_t, fixed_geometry_t<uint16_t, 4>>>("fixed_geometry_t<u16_t, 4>");
+}
@@ -0,0 +1,337 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <list>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+
+#include "../multi_pool_alloc.hpp"
+
+
+static constexpr uint64_t cycles = 1 << 6;
+static constexpr uint64_t total_allocated_resources = uint64_t(1) << 14;
+static constexpr uint64_t max_index = ~uint64_t(0);
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_threads: " << what << std::endl;
+        std::_Exit(1);
+    }
+}
+
+
+template <template <typename> typename Allocator>
+auto run_containers(uint32_t thread_count) -> void
+{
+    using map_t = std::map<uint64_t, uint64_t, std::less<uint64_t>, Allocator<std::pair<const uint64_t, uint64_t>>>;
+    using list_t = std::list<uint64_t, Allocator<uint64_t>>;
+
+    // Every thread builds and clears its own maps.
+    std::vector<std::thread> threads;
+    for (auto t = 0u; t < thread_count; ++t)
+    {
+        threads.emplace_back([t]()
+        {
+            std::mt19937 mt(t);
+            std::uniform_int_distribution<uint64_t> dist(0, max_index);
+            map_t map;
+
+            for (auto i = 0; i < cycles; ++i)
+            {
+                for (auto j = 0; j < total_allocated_resources; ++j)
+                {
+                    map.emplace(dist(mt), dist(mt));
+                }
+                map.clear();
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    threads.clear();
+
+    // Producers allocate list nodes that are freed by the consumer thread.
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::queue<list_t> queue;
+    auto producers = thread_count - 1;
+
+    for (auto t = 0u; t < producers; ++t)
+    {
+        threads.emplace_back([&]()
+        {
+            for (auto i = 0; i < cycles; ++i)
+            {
+                list_t list;
+                for (auto j = 0; j < total_allocated_resources; ++j)
+                {
+                    list.push_back(j);
+                }
+
+                std::lock_guard<std::mutex> lg(queue_mutex);
+                queue.push(std::move(list));
+                queue_cv.notify_one();
+            }
+        });
+    }
+
+    threads.emplace_back([&]()
+    {
+        for (auto i = 0u; i < producers * cycles; ++i)
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [&]() { return !queue.empty(); });
+            auto list = std::move(queue.front());
+            queue.pop();
+            lock.unlock();
+            list.clear();
+        }
+    });
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    threads.clear();
+
+    // Arrays of objects smaller than a pointer are freed by the next thread.
+    using bytes_t = std::vector<char, Allocator<char>>;
+    std::vector<std::vector<bytes_t>> bytes(thread_count);
+
+    for (auto t = 0u; t < thread_count; ++t)
+    {
+        threads.emplace_back([&bytes, t]()
+        {
+            for (auto i = 0; i < total_allocated_resources; ++i)
+            {
+                bytes[t].emplace_back(size_t(1 + i % 100), char(i));
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    threads.clear();
+
+    for (auto t = 0u; t < thread_count; ++t)
+    {
+        threads.emplace_back([&bytes, t, thread_count]()
+        {
+            bytes[(t + 1) % thread_count].clear();
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+
+// Objects of one thread carry its tag, a slot handed to two threads at once ends up with the wrong one.
+struct tagged_t
+{
+    uint64_t tag;
+    uint64_t payload[2];
+};
+
+// Constructed before the first allocation of its thread, so it is destroyed after the allocator has given up
+// the state of the thread, and frees and allocates from there.
+template <template <typename> typename Allocator>
+struct late_holder_t
+{
+    ~late_holder_t()
+    {
+        Allocator<tagged_t> allocator;
+        for (auto object : objects)
+        {
+            check(object->tag == tag, "slot of an exiting thread handed out again");
+            allocator.deallocate(object, 1);
+        }
+
+        auto late = allocator.allocate(1);
+        late->tag = tag;
+        allocator.deallocate(late, 1);
+    }
+
+    uint64_t tag = 0;
+    std::vector<tagged_t*> objects;
+};
+
+template <template <typename> typename Allocator>
+auto run_thread_exit(uint32_t thread_count) -> void
+{
+    // Threads keep exiting while others take over their heaps and allocate.
+    std::vector<std::thread> threads;
+    for (auto t = 0u; t < thread_count * cycles; ++t)
+    {
+        threads.emplace_back([t]()
+        {
+            static thread_local late_holder_t<Allocator> holder;
+            holder.tag = t;
+
+            Allocator<tagged_t> allocator;
+            for (auto i = 0; i < total_allocated_resources; ++i)
+            {
+                auto object = allocator.allocate(1);
+                object->tag = t;
+                holder.objects.push_back(object);
+            }
+            for (auto object : holder.objects)
+            {
+                check(object->tag == t, "slot handed to two threads");
+            }
+        });
+
+        if (threads.size() == thread_count)
+        {
+            threads.front().join();
+            threads.erase(threads.begin());
+        }
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+// Slots of the shared pool behind allocator_t<tagged_t> that are allocated or wait in a thread cache.
+auto shared_live_slots() -> size_t
+{
+    auto stats = mpa::allocator_t<tagged_t>::stats();
+    auto live = 0.0;
+    for (auto occupancy : stats.block_occupancy)
+    {
+        live += occupancy * double(stats.block_capacity);
+    }
+    return size_t(live + 0.5);
+}
+
+auto run_cache_exit(uint32_t thread_count) -> void
+{
+    // Slots freed after the cache of their thread is gone must reach the shared pool, or they stay live forever.
+    mpa::allocator_t<tagged_t>::trim();
+    auto live = shared_live_slots();
+    run_thread_exit<mpa::allocator_t>(thread_count);
+    mpa::allocator_t<tagged_t>::trim();
+    check(shared_live_slots() == live, "slots freed by an exiting thread lost");
+}
+
+
+auto run_concurrent_pool(uint32_t thread_count) -> void
+{
+    // All threads allocate from and free to one lock free pool. Every slot records its owner, so a slot handed
+    // to two threads at once is found by the exchange that takes it and by the tag the other thread wrote into it.
+    auto concurrent_pool = new mpa::concurrent_pool_t<uint64_t>;
+    concurrent_pool->init();
+    std::vector<std::atomic<uint32_t>> owners(concurrent_pool->pool_size);
+
+    std::vector<std::thread> threads;
+    for (auto t = 0u; t < thread_count; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::vector<uint64_t*> slots;
+            for (auto i = 0; i < cycles * cycles; ++i)
+            {
+                auto tag = uint64_t(t) << 32 | uint64_t(i);
+                while (auto slot = concurrent_pool->allocate())
+                {
+                    auto& owner = owners[slot - concurrent_pool->data];
+                    check(owner.exchange(t + 1) == 0, "concurrent pool slot handed to two threads");
+                    *slot = tag;
+                    slots.push_back(slot);
+                    if (slots.size() == concurrent_pool->pool_size / thread_count)
+                    {
+                        break;
+                    }
+                }
+
+                for (auto slot : slots)
+                {
+                    check(*slot == tag, "concurrent pool slot overwritten by another thread");
+                    owners[slot - concurrent_pool->data].store(0);
+                    concurrent_pool->deallocate(slot);
+                }
+                slots.clear();
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    // Every slot was given back, so the pool hands all of them out again.
+    auto allocated = size_t(0);
+    while (concurrent_pool->allocate())
+    {
+        ++allocated;
+    }
+    check(allocated == concurrent_pool->pool_size, "concurrent pool lost slots");
+    delete concurrent_pool;
+}
+
+
+template <typename Function>
+auto timed(const char* name, Function function) -> void
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    function();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto ms_passed = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    std::cout << name << " finished in " << ms_passed << " ms" << std::endl;
+}
+
+
+int main()
+{
+    auto thread_count = std::max(2u, std::thread::hardware_concurrency());
+    std::cout << thread_count << " threads" << std::endl;
+
+    timed("allocator_t", [&]() { run_containers<mpa::allocator_t>(thread_count); });
+    timed("thread_heap_allocator_t", [&]() { run_containers<mpa::thread_heap_allocator_t>(thread_count); });
+    timed("allocator_t thread exit", [&]() { run_cache_exit(thread_count); });
+    timed("thread_heap_allocator_t thread exit", [&]() { run_thread_exit<mpa::thread_heap_allocator_t>(thread_count); });
+    timed("concurrent_pool_t", [&]() { run_concurrent_pool(thread_count); });
+}
@@ -0,0 +1,219 @@
+// MIT License
+// 
+// Copyright (c) 2023 Mihail Mladenov
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Empty blocks are kept up to set_retained_empty_blocks and released beyond it. trim releases or decommits
+// the empty blocks that are left down to retain and leaves blocks with live objects alone. Decommitted blocks
+// stay with the pool and are used again before new blocks are allocated.
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "../multi_pool_alloc.hpp"
+
+
+struct object_t
+{
+    uint64_t values[2];
+};
+
+// Blocks of 1024 slots, so a few thousand objects fill several blocks.
+using pool_t = mpa::multi_pool_t<object_t, mpa::heap_block_provider_t, mpa::fixed_geometry_t<uint16_t, 4>>;
+
+
+auto check(bool condition, const char* what) -> void
+{
+    if (!condition)
+    {
+        std::cerr << "test_trim: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+
+// Fills blocks of pool with numbered objects, block by block.
+auto fill(pool_t& pool, size_t blocks) -> std::vector<object_t*>
+{
+    std::vector<object_t*> objects(blocks * pool.stats().block_capacity);
+    for (auto i = size_t(0); i < objects.size(); ++i)
+    {
+        objects[i] = pool.allocate(1);
+        objects[i]->values[0] = i;
+    }
+    return objects;
+}
+
+// Frees the objects of block, numbered in the order of fill.
+auto free_block(pool_t& pool, std::vector<object_t*>& objects, size_t block) -> void
+{
+    auto capacity = pool.stats().block_capacity;
+    for (auto i = block * capacity; i < (block + 1) * capacity; ++i)
+    {
+        pool.deallocate(objects[i], 1);
+        objects[i] = nullptr;
+    }
+}
+
+auto check_objects(const std::vector<object_t*>& objects) -> void
+{
+    for (auto i = size_t(0); i < objects.size(); ++i)
+    {
+        check(!objects[i] || objects[i]->values[0] == i, "live object overwritten");
+    }
+}
+
+
+auto test_retained() -> void
+{
+    pool_t pool;
+    pool.allocate(1);
+    auto capacity = pool.stats().block_capacity;
+    check(capacity >= 64, "blocks too small");
+
+    // The first slot is still live, so the first block stays and one more empty block is retained.
+    auto objects = fill(pool, 4);
+    for (auto block = size_t(0); block < 4; ++block)
+    {
+        free_block(pool, objects, block);
+    }
+    auto stats = pool.stats();
+    check(stats.blocks == 2 && stats.empty_blocks == 1, "deallocate kept more empty blocks than retained");
+
+    pool.set_retained_empty_blocks(3);
+    objects = fill(pool, 4);
+    for (auto block = size_t(0); block < 4; ++block)
+    {
+        free_block(pool, objects, block);
+    }
+    stats = pool.stats();
+    check(stats.blocks == 4 && stats.empty_blocks == 3, "deallocate did not keep the retained empty blocks");
+}
+
+auto test_release() -> void
+{
+    pool_t pool;
+    pool.set_retained_empty_blocks(8);
+
+    // Blocks 0 and 2 are emptied, blocks 1 and 3 keep their objects.
+    auto objects = fill(pool, 4);
+    free_block(pool, objects, 0);
+    free_block(pool, objects, 2);
+    auto stats = pool.stats();
+    check(stats.blocks == 4 && stats.empty_blocks == 2, "emptied blocks not retained");
+
+    check(pool.trim(1, mpa::trim_t::release) == 1, "trim(1) did not release one block");
+    stats = pool.stats();
+    check(stats.blocks == 3 && stats.empty_blocks == 1, "trim(1) left the wrong blocks");
+    check(pool.trim(1, mpa::trim_t::release) == 0, "trim(1) released a retained block");
+    check(pool.trim() == 1, "trim() did not release the last empty block");
+    stats = pool.stats();
+    check(stats.blocks == 2 && stats.empty_blocks == 0, "trim() left an empty block");
+    for (auto occupancy : stats.block_occupancy)
+    {
+        check(occupancy == 1.0, "trim released a block with live objects");
+    }
+    check_objects(objects);
+
+    // Releasing blocks moves others into their place, objects must still be found and freed.
+    free_block(pool, objects, 1);
+    free_block(pool, objects, 3);
+    check(pool.trim() == 2, "trim() did not release the blocks emptied later");
+    check(pool.stats().blocks == 0, "trim() left blocks behind");
+
+    objects = fill(pool, 2);
+    check(pool.stats().blocks == 2, "released blocks not allocated again");
+    check_objects(objects);
+}
+
+auto test_decommit() -> void
+{
+    pool_t pool;
+    pool.set_retained_empty_blocks(8);
+
+    auto objects = fill(pool, 4);
+    free_block(pool, objects, 1);
+    free_block(pool, objects, 2);
+    free_block(pool, objects, 3);
+
+    check(pool.trim(1, mpa::trim_t::decommit) == 2, "trim(1, decommit) did not decommit two blocks");
+    auto stats = pool.stats();
+    check(stats.blocks == 4 && stats.empty_blocks == 1 && stats.decommitted_blocks == 2,
+        "trim(1, decommit) did not keep the decommitted blocks");
+    check(pool.trim(0, mpa::trim_t::decommit) == 1, "trim(0, decommit) did not decommit the last empty block");
+    check(pool.trim(0, mpa::trim_t::decommit) == 0, "a block was decommitted twice");
+    stats = pool.stats();
+    check(stats.blocks == 4 && stats.empty_blocks == 0 && stats.decommitted_blocks == 3,
+        "trim(0, decommit) lost blocks");
+    check(stats.block_occupancy[0] == 1.0, "trim decommitted a block with live objects");
+    check_objects(objects);
+
+    // Decommitted blocks are committed again and filled before any new block is allocated.
+    std::vector<object_t*> more(3 * stats.block_capacity);
+    for (auto i = size_t(0); i < more.size(); ++i)
+    {
+        more[i] = pool.allocate(1);
+        more[i]->values[0] = ~uint64_t(i);
+    }
+    stats = pool.stats();
+    check(stats.blocks == 4 && stats.decommitted_blocks == 0, "decommitted blocks not used again");
+    for (auto i = size_t(0); i < more.size(); ++i)
+    {
+        check(more[i]->values[0] == ~uint64_t(i), "object in a recommitted block overwritten");
+    }
+    check_objects(objects);
+
+    for (auto ptr : more)
+    {
+        pool.deallocate(ptr, 1);
+    }
+    free_block(pool, objects, 0);
+    check(pool.trim() == 4, "trim() did not release the recommitted blocks");
+    check(pool.stats().blocks == 0, "trim() left blocks behind");
+}
+
+auto test_resource() -> void
+{
+    mpa::pool_resource_t resource;
+    std::vector<void*> ptrs(4096);
+    for (auto& ptr : ptrs)
+    {
+        ptr = resource.allocate(48, 16);
+    }
+    for (auto ptr : ptrs)
+    {
+        resource.deallocate(ptr, 48, 16);
+    }
+    check(resource.trim() > 0, "pool_resource_t::trim() released no blocks");
+    check(resource.trim() == 0, "pool_resource_t::trim() released blocks twice");
+}
+
+
+int main()
+{
+    test_retained();
+    test_release();
+    test_decommit();
+    test_resource();
+
+    std::cout << "test_trim passed" << std::endl;
+    return 0;
+}